@@ -15,150 +15,2226 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <new>
+#include <cstdio>
+#include <chrono>
 // Multithreading
 #include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <queue>
+#include <vector>
+#include <map>
+#include <deque>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+// Distributed mode, plain TCP sockets
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/un.h>
+// Result cache file, mapped into memory
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+// Vector kernels, chosen at runtime
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+// Library interface
+#include "bbp-pi-parallel.h"
+// Progress, profiling, JSON and position list helpers shared with the GPU program
+#include "bbp-pi-parallel-internal.h"
 
-uint noOfThreads;
+namespace {
 
-// Left-Right Binary algorithm for exponentiation with Modulo 16^n mod k
-double expoMod(double n, double k)
-  {
-    static int init = 0; // Store whether table initialised
-    static int pwrtbl[64]; // Table to store powers of 2
-    static int highestpwrtblpwr = 0; // After init, points to largest value in the table, which is <= n
-    while (!init) // Find largest power needed, as n counts down, do this only once
+// Counts the unfinished tasks of one caller, so several callers can share the pool and each wait for only its own tasks
+struct TaskGroup
+{
+  uint outstanding = 0; // Tasks queued or running, guarded by the pool's queue mutex
+};
+
+thread_local uint workerIndex = 0; // Which pool worker this thread is, 0 for threads outside the pool
+
+// Pool of long-lived worker threads which take tasks from a shared queue
+class ThreadPool
+{
+  public:
+    // Worker i is pinned to cpus[i % cpus.size()], or left to the OS when cpus is empty
+    ThreadPool(uint threads, const std::vector<int> &cpus = std::vector<int>())
+    {
+      for (uint i = 0; i < threads; i++)
+      {
+        workers.push_back(std::thread(&ThreadPool::workerLoop, this, i + 1, cpus.empty() ? -1 : cpus[i % cpus.size()]));
+      }
+    }
+
+    ~ThreadPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopping = true;
+      }
+      taskAvailable.notify_all();
+      for (uint i = 0; i < workers.size(); i++)
+      {
+        workers[i].join();
+      }
+      for (size_t i = 0; i < allLines.size(); i++) {free(allLines[i]);}
+    }
+
+    // Add a task to the queue, the first idle worker will pick it up
+    void submit(TaskGroup &group, std::function<void()> task)
+    {
+      {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        tasks.push(std::make_pair(task, &group));
+        group.outstanding++;
+      }
+      taskAvailable.notify_one();
+    }
+
+    // A zeroed cache line for each worker, index workerIndex, plus line 0 for threads outside the pool. So a caller's tasks
+    // can accumulate without workers writing to the same line. Sets are reused, a new one is only allocated while every
+    // earlier set is still in use by another caller
+    void *acquireLines()
+    {
+      void *lines = nullptr;
+      {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (!freeLines.empty()) {lines = freeLines.back(); freeLines.pop_back();}
+      }
+      if (!lines)
+      {
+        if (posix_memalign(&lines, 64, 64 * (workers.size() + 1)) != 0) {throw std::bad_alloc();}
+        std::lock_guard<std::mutex> lock(queueMutex);
+        allLines.push_back(lines);
+      }
+      std::memset(lines, 0, 64 * (workers.size() + 1));
+      return lines;
+    }
+
+    void releaseLines(void *lines)
+    {
+      std::lock_guard<std::mutex> lock(queueMutex);
+      freeLines.push_back(lines);
+    }
+
+    // Block until every task submitted to the group has finished
+    void wait(TaskGroup &group)
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      tasksDone.wait(lock, [&group]{ return group.outstanding == 0; });
+    }
+
+    // As wait but give up after (seconds), returns true if the group finished
+    bool waitFor(TaskGroup &group, double seconds)
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      return tasksDone.wait_for(lock, std::chrono::duration<double>(seconds), [&group]{ return group.outstanding == 0; });
+    }
+
+    uint size() const { return workers.size(); }
+
+  private:
+    std::vector<std::thread> workers;
+    std::queue<std::pair<std::function<void()>, TaskGroup *>> tasks;
+    std::mutex queueMutex;
+    std::condition_variable taskAvailable; // Signalled when a task is queued or the pool is stopping
+    std::condition_variable tasksDone; // Signalled when the outstanding count of a group reaches zero
+    bool stopping = false;
+    std::vector<void *> allLines, freeLines; // Sets from acquireLines, guarded by the queue mutex
+
+    void workerLoop(uint index, int cpu)
     {
-      pwrtbl[0] = 1; // In theory first can be 0 but in practice this function is only called if n > 0, in which case greatest power is 1 or more
-      while (pwrtbl[highestpwrtblpwr] < n) // Used instead of for loop in order to check before iterating
+      workerIndex = index;
+#if defined(__linux__)
+      if (cpu >= 0)
+      {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      }
+#endif
+      while (true)
       {
-        pwrtbl[highestpwrtblpwr+1] = pwrtbl[highestpwrtblpwr] * 2; // Only generates up to and including n, nothing larger
-        highestpwrtblpwr++;
+        std::pair<std::function<void()>, TaskGroup *> task;
+        {
+          std::unique_lock<std::mutex> lock(queueMutex);
+          taskAvailable.wait(lock, [this]{ return stopping || !tasks.empty(); });
+          if (tasks.empty()) {return;} // Only reached when stopping
+          task = tasks.front();
+          tasks.pop();
+        }
+        task.first();
+        {
+          std::lock_guard<std::mutex> lock(queueMutex);
+          task.second->outstanding--;
+          if (task.second->outstanding == 0) {tasksDone.notify_all();}
+        }
       }
-      init = 1; // Set table as initialised
     }
+};
+
+uint noOfThreads;
+ThreadPool *workerPool; // Created once in main and shared by every series and position
+std::vector<int> workerCpus; // CPUs the pool workers are pinned to, empty for none
+
+// Parse a sysfs CPU list such as 0-7,16-23
+std::vector<int> parseCpuList(const std::string &list)
+{
+  std::vector<int> cpus;
+  std::stringstream items(list);
+  for (std::string item; std::getline(items, item, ',');)
+  {
+    int first, last;
+    char dash;
+    std::stringstream range(item);
+    if (!(range >> first)) {continue;}
+    last = range >> dash >> last ? last : first;
+    for (int cpu = first; cpu <= last; cpu++) {cpus.push_back(cpu);}
+  }
+  return cpus;
+}
+
+// CPUs for --affinity from the sysfs topology, ordered so that consecutive workers go to different physical cores of one NUMA
+// node before moving to the next node, and SMT siblings only come after every core has a worker. With physicalOnly the
+// siblings are left out altogether, the FP-bound loop gains little from them. Only CPUs this process may run on are used
+std::vector<int> affinityCpus(bool physicalOnly, int &nodes)
+{
+  struct CpuPlace { int sibling, node, package, core, cpu; };
+  std::vector<CpuPlace> places;
+  std::vector<int> nodeOf;
+  nodes = 0;
+  for (int node = 0;; node++)
+  {
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    if (!std::getline(file, list)) {break;}
+    std::vector<int> cpus = parseCpuList(list);
+    for (size_t i = 0; i < cpus.size(); i++)
+    {
+      if (cpus[i] >= static_cast<int>(nodeOf.size())) {nodeOf.resize(cpus[i] + 1, 0);}
+      nodeOf[cpus[i]] = node;
+    }
+    nodes++;
+  }
+#if defined(__linux__)
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {return std::vector<int>();}
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+  {
+    if (!CPU_ISSET(cpu, &allowed)) {continue;}
+    std::string topology = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+    std::ifstream packageFile(topology + "physical_package_id"), coreFile(topology + "core_id");
+    CpuPlace place = {0, cpu < static_cast<int>(nodeOf.size()) ? nodeOf[cpu] : 0, 0, cpu, cpu};
+    packageFile >> place.package;
+    coreFile >> place.core;
+    for (size_t i = 0; i < places.size(); i++) // Count the earlier CPUs on the same core
+    {
+      if (places[i].package == place.package && places[i].core == place.core) {place.sibling++;}
+    }
+    places.push_back(place);
+  }
+#endif
+  std::sort(places.begin(), places.end(), [](const CpuPlace &a, const CpuPlace &b)
+  {
+    if (a.sibling != b.sibling) {return a.sibling < b.sibling;}
+    if (a.node != b.node) {return a.node < b.node;}
+    if (a.package != b.package) {return a.package < b.package;}
+    return a.core != b.core ? a.core < b.core : a.cpu < b.cpu;
+  });
+  std::vector<int> cpus;
+  for (size_t i = 0; i < places.size(); i++)
+  {
+    if (!physicalOnly || places[i].sibling == 0) {cpus.push_back(places[i].cpu);}
+  }
+  return cpus;
+}
+
+// The four series of the formula are evaluated together, S1, S4, S5 & S6
+const int seriesJ[4] = {1, 4, 5, 6}; // j for each series, the denominators are 8k+j
+const double seriesWeight[4] = {4., -2., -1., -1.}; // 16^d x Pi = 4S1 - 2S4 - S5 - S6
+
+// Fixed point fractions, the value is v/2^64 (or v/2^128). Only the fractional part of each sum matters, and addition
+// wrapping round the top of the integer gives mod 1 for free, so there is no floor and no rounding drift as d grows
+struct Fixed64 { uint64_t v; };
+struct Fixed128 { unsigned __int128 v; };
+
+// Compilers must not reassociate the error-free transformations of the double-double type, even in an -Ofast build.
+// Clang can turn fast math off inside the function. GCC's optimize attribute would stop the functions inlining into the
+// -Ofast kernels, so instead each rounded intermediate goes through an empty asm the optimiser can't see into
+#if defined(__clang__)
+#define STRICT_FP_BODY _Pragma("float_control(precise, on)")
+#else
+#define STRICT_FP_BODY
+#endif
+#if defined(__GNUC__) && !defined(__clang__)
+#if defined(__SSE2_MATH__)
+#define STRICT_FP_REG "+x"
+#elif defined(__aarch64__)
+#define STRICT_FP_REG "+w"
+#else
+#define STRICT_FP_REG "+m"
+#endif
+static inline double strictFp(double x) { __asm__("" : STRICT_FP_REG(x)); return x; }
+#else
+static inline double strictFp(double x) { return x; }
+#endif
+
+// Portable builds (BBP_MULTIVERSION, set by the CMake build) compile the generic kernels once for each x86-64 level and
+// the loader picks the best one for the CPU. The AVX2 and AVX-512 kernels are chosen at runtime either way
+#if defined(BBP_MULTIVERSION) && defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#define KERNEL_CLONES __attribute__((target_clones("default", "arch=x86-64-v2", "arch=x86-64-v3", "arch=x86-64-v4")))
+#else
+#define KERNEL_CLONES
+#endif
+
+// Double-double, an unevaluated sum hi + lo of two doubles with |lo| <= ulp(hi)/2, giving about 106 bits of mantissa
+// in hardware floating point. Much cheaper than the software __float128
+struct DoubleDouble
+{
+  double hi, lo;
+  DoubleDouble() : hi(0), lo(0) {}
+  DoubleDouble(double h, double l) : hi(h), lo(l) {}
+  DoubleDouble(double x) : hi(x), lo(0) {}
+  DoubleDouble(int64_t x) { STRICT_FP_BODY hi = strictFp(static_cast<double>(x)); lo = static_cast<double>(x - static_cast<int64_t>(hi)); }
+  DoubleDouble(uint64_t x) { STRICT_FP_BODY hi = strictFp(static_cast<double>(x)); lo = static_cast<double>(static_cast<int64_t>(x - static_cast<uint64_t>(hi))); }
+};
+
+static inline DoubleDouble quickTwoSum(double a, double b) // Needs |a| >= |b|
+{
+  STRICT_FP_BODY
+  double s = strictFp(a + b);
+  return DoubleDouble(s, b - strictFp(s - a));
+}
+
+static inline DoubleDouble twoSum(double a, double b)
+{
+  STRICT_FP_BODY
+  double s = strictFp(a + b);
+  double bb = strictFp(s - a);
+  return DoubleDouble(s, strictFp(a - strictFp(s - bb)) + strictFp(b - bb));
+}
+
+static inline DoubleDouble operator+(DoubleDouble a, DoubleDouble b)
+{
+  STRICT_FP_BODY
+  DoubleDouble s = twoSum(a.hi, b.hi);
+  DoubleDouble t = twoSum(a.lo, b.lo);
+  s = quickTwoSum(s.hi, s.lo + t.hi);
+  return quickTwoSum(s.hi, s.lo + t.lo);
+}
+
+static inline DoubleDouble operator-(DoubleDouble a) { return DoubleDouble(-a.hi, -a.lo); }
+static inline DoubleDouble operator-(DoubleDouble a, DoubleDouble b) { return a + (-b); }
+
+static inline DoubleDouble operator*(DoubleDouble a, DoubleDouble b)
+{
+  STRICT_FP_BODY
+  double p = strictFp(a.hi * b.hi);
+  double e = std::fma(a.hi, b.hi, -p); // Exact error of the product
+  return quickTwoSum(p, e + (a.hi * b.lo + a.lo * b.hi));
+}
+
+static inline DoubleDouble operator/(DoubleDouble a, DoubleDouble b)
+{
+  STRICT_FP_BODY
+  double q1 = a.hi / b.hi; // Long division, each step corrects the remainder of the last
+  DoubleDouble r = a - b * DoubleDouble(q1);
+  double q2 = r.hi / b.hi;
+  r = r - b * DoubleDouble(q2);
+  double q3 = r.hi / b.hi;
+  return quickTwoSum(q1, q2) + DoubleDouble(q3);
+}
+
+static inline bool operator>=(DoubleDouble a, DoubleDouble b) { return a.hi > b.hi || (a.hi == b.hi && a.lo >= b.lo); }
+static inline bool operator<(DoubleDouble a, DoubleDouble b) { return !(a >= b); }
+
+// Floor and truncation for each arithmetic type, __float128 avoids needing libquadmath, values are always below 2^63
+static inline double floorReal(double x) { return std::floor(x); }
+static inline long double floorReal(long double x) { return std::floor(x); }
+static inline __float128 floorReal(__float128 x)
+{
+  __float128 t = static_cast<__float128>(static_cast<int64_t>(x));
+  return t > x ? t - 1 : t;
+}
+static inline DoubleDouble floorReal(DoubleDouble x)
+{
+  STRICT_FP_BODY
+  double h = std::floor(x.hi);
+  if (h != x.hi) {return DoubleDouble(h, 0.);}
+  return quickTwoSum(h, std::floor(x.lo));
+}
+
+template <typename Real> static inline Real truncReal(Real x) { return static_cast<Real>(static_cast<int64_t>(x)); }
+template <> inline DoubleDouble truncReal<DoubleDouble>(DoubleDouble x) { return x.hi < 0 ? -floorReal(-x) : floorReal(x); }
+template <typename Real> static inline int truncInt(Real x) { return static_cast<int>(x); }
+template <> inline int truncInt<DoubleDouble>(DoubleDouble x) { return static_cast<int>(truncReal(x).hi); }
+
+// s ← (s + x) mod 1
+template <typename Real> static inline void fracAdd(Real &s, Real x) { s = s + x; s = s - floorReal(s); }
+static inline void fracAdd(Fixed64 &s, Fixed64 x) { s.v = s.v + x.v; }
+static inline void fracAdd(Fixed128 &s, Fixed128 x) { s.v = s.v + x.v; }
+
+// Partial sums are added up in 128-bit fixed point, where addition is exact, so they give the same bits in any order.
+// A partial sum x in (-1, 1) is truncated to a multiple of 2^-128, far below the rounding of any of the types
+const double twoTo64 = 18446744073709551616.;
+template <typename Real> static inline Fixed128 toFixed128(Real x)
+{
+  bool negative = x < Real(0.);
+  if (negative) {x = -x;}
+  if (!(x < Real(1.))) {x = x - Real(1.);} // s - floor(s) can round up to 1
+  Real scaled = x * Real(twoTo64); // Scaling by powers of two and taking the whole part are exact
+  uint64_t high = static_cast<uint64_t>(scaled);
+  uint64_t low = static_cast<uint64_t>((scaled - Real(high)) * Real(twoTo64));
+  Fixed128 f;
+  f.v = (static_cast<unsigned __int128>(high) << 64) | low;
+  if (negative) {f.v = -f.v;}
+  return f;
+}
+static inline Fixed128 toFixed128(DoubleDouble x) { Fixed128 f = toFixed128(x.hi); f.v = f.v + toFixed128(x.lo).v; return f; }
+static inline Fixed128 toFixed128(Fixed64 x) { Fixed128 f; f.v = static_cast<unsigned __int128>(x.v) << 64; return f; }
+static inline Fixed128 toFixed128(Fixed128 x) { return x; }
+
+template <typename Real> static inline Real fromFixed128(Fixed128 f)
+{
+  return Real(static_cast<uint64_t>(f.v >> 64)) * Real(1./twoTo64) + Real(static_cast<uint64_t>(f.v)) * Real(1./twoTo64) * Real(1./twoTo64);
+}
+template <> inline Fixed64 fromFixed128<Fixed64>(Fixed128 f) { Fixed64 r; r.v = static_cast<uint64_t>(f.v >> 64); return r; }
+template <> inline Fixed128 fromFixed128<Fixed128>(Fixed128 f) { return f; }
+
+// Partial sums of the four series, exactly one cache line
+struct SeriesSums
+{
+  Fixed128 s[4];
+};
+static_assert(sizeof(SeriesSums) == 64, "SeriesSums should fill one cache line");
+
+template <typename Real> static inline void addSums(SeriesSums &sums, const Real *part)
+{
+  for (int l = 0; l < 4; l++) {sums.s[l].v = sums.s[l].v + toFixed128(part[l]).v;}
+}
+
+// r/m for r < m, in the accumulator type. The fixed point versions use integer division, so they are the exact fraction truncated
+template <typename Real> Real fraction(uint64_t r, uint64_t m) { return Real(r)/Real(m); }
+template <> inline DoubleDouble fraction<DoubleDouble>(uint64_t r, uint64_t m) // r and m are exact in a double
+{
+  STRICT_FP_BODY
+  double q1 = strictFp(static_cast<double>(r)/static_cast<double>(m));
+  double e = std::fma(-q1, static_cast<double>(m), static_cast<double>(r)); // Exact remainder
+  return quickTwoSum(q1, e/static_cast<double>(m));
+}
+template <> inline Fixed64 fraction<Fixed64>(uint64_t r, uint64_t m)
+{
+  Fixed64 f = { static_cast<uint64_t>((static_cast<unsigned __int128>(r) << 64) / m) };
+  return f;
+}
+template <> inline Fixed128 fraction<Fixed128>(uint64_t r, uint64_t m)
+{
+  unsigned __int128 n = static_cast<unsigned __int128>(r) << 64; // Long division one 64-bit digit at a time
+  uint64_t high = static_cast<uint64_t>(n / m);
+  n = (n % m) << 64;
+  uint64_t low = static_cast<uint64_t>(n / m);
+  Fixed128 f = { (static_cast<unsigned __int128>(high) << 64) | low };
+  return f;
+}
+
+// Bits of precision of a sum in [0, 1), the Right Portion stops once its terms are below half an ulp of that
+template <typename Real> static inline int sumBits() { return std::numeric_limits<Real>::digits; }
+template <> inline int sumBits<DoubleDouble>() { return 106; }
+template <> inline int sumBits<__float128>() { return 113; } // std::numeric_limits only knows __float128 with GNU extensions
+template <> inline int sumBits<Fixed64>() { return 64; }
+template <> inline int sumBits<Fixed128>() { return 128; }
+
+// Right Portion of the four series, for k = d, d+1 ... until even S1's term, the largest, no longer changes the sum.
+// 16^(d-k) is a running product, division by 16 is exact
+template <typename Real> static inline void rightPortion(Real *s, int64_t d)
+{
+  Real bound = Real(1.);
+  for (int b = 0; b < sumBits<Real>(); b++) {bound = bound/Real(2.);}
+  Real power = Real(1.);
+  for (int64_t k = d; power/Real(8 * k + seriesJ[0]) >= bound; k++)
+  {
+    for (int l = 0; l < 4; l++) {fracAdd(s[l], power/Real(8 * k + seriesJ[l]));}
+    power = power/Real(16.);
+  }
+}
+
+// Fixed point Right Portion term 16^-i/k, returns false once the term is too small to change the sum
+static inline bool rightTerm(Fixed64 &term, int64_t i, int64_t k)
+{
+  if (4*i >= 64) {return false;}
+  term = fraction<Fixed64>(1, k); // floor(floor(2^64/k)/16^i) is floor(2^64/(16^i k)) so the shift is exact
+  term.v = term.v >> (4*i);
+  return term.v != 0 || i == 0; // At d = 0 the first term of S1 is 1/1, which is 0 mod 1 but not small
+}
+static inline bool rightTerm(Fixed128 &term, int64_t i, int64_t k)
+{
+  if (4*i >= 128) {return false;}
+  term = fraction<Fixed128>(1, k);
+  term.v = term.v >> (4*i);
+  return term.v != 0 || i == 0;
+}
+
+template <typename Fixed> static inline void rightPortionFixed(Fixed *s, int64_t d)
+{
+  Fixed term;
+  for (int64_t k = d; rightTerm(term, k - d, 8 * k + seriesJ[0]); k++) // S1 has the smallest denominator, so the largest term
+  {
+    for (int l = 0; l < 4; l++)
+    {
+      rightTerm(term, k - d, 8 * k + seriesJ[l]);
+      fracAdd(s[l], term);
+    }
+  }
+}
+static inline void rightPortion(Fixed64 *s, int64_t d) { rightPortionFixed(s, d); }
+static inline void rightPortion(Fixed128 *s, int64_t d) { rightPortionFixed(s, d); }
+
+// 4S1 - 2S4 - S5 - S6 mod 1
+template <typename Real> static inline void combineSeries(Real &result, const Real *sj)
+{
+  result = Real(0.);
+  for (int l = 0; l < 4; l++) {result = result + Real(seriesWeight[l])*sj[l];}
+  result = result - truncReal(result) + Real(1.);
+}
+static inline void combineSeries(Fixed64 &result, const Fixed64 *sj)
+{
+  result.v = 4*sj[0].v - 2*sj[1].v - sj[2].v - sj[3].v; // Unsigned wraparound is the mod 1
+}
+static inline void combineSeries(Fixed128 &result, const Fixed128 *sj)
+{
+  result.v = 4*sj[0].v - 2*sj[1].v - sj[2].v - sj[3].v;
+}
 
-    int bitsneeded = 0; // The number of binary positions and the location in the table of the highest needed power
-    for (; pwrtbl[bitsneeded]<n;bitsneeded++); // Move through table to find position of the largest power of two < n
-    if (pwrtbl[bitsneeded]!=n){bitsneeded--;} // Because the increment is applied before the condition check, we need to decrement by one, unless the item was equal to n
+// Left-Right Binary algorithm for exponentiation with Modulo 16^n mod k, for the four denominators of one term at once
+// The exponent is the same for all four so the square-and-multiply control flow is shared, only the reductions are done per modulus
+template <typename Real> void expoMod(int64_t n, const Real *k, Real *r)
+  {
+    int bitsneeded = 63 - __builtin_clzll(n); // The number of binary positions, the position of the highest set bit of n (n is always > 0 here)
 
     // First set t to be the largest power of two such that t ≤ n, and set r = 1.
-    int t = pwrtbl[bitsneeded];
-    double r = 1;
+    int64_t t = static_cast<int64_t>(1) << bitsneeded;
+    for (int l = 0; l < 4; l++) {r[l] = Real(1.);}
 
     // Loop by the number of Binary positions
     for (int i = 0; i <= bitsneeded; i++)
     {
       if (n>=t) // if n ≥ t then
       {
-        r = r * 16.0; // r ← br
-        r = r - static_cast<int>(r/k)*k; // r ← r mod k
+        for (int l = 0; l < 4; l++)
+        {
+          r[l] = r[l] * Real(16.0); // r ← br
+          r[l] = r[l] - truncReal(r[l]/k[l])*k[l]; // r ← r mod k
+        }
         n = n - t; // n ← n − t
       }
       t = t/2; // t ← t/2
       if (t>=1) // if t ≥ 1 then
       {
-        r = r * r; // r ← r^2
-        r = r - static_cast<int>(r/k)*k; // r ← r mod k
+        for (int l = 0; l < 4; l++)
+        {
+          r[l] = r[l] * r[l]; // r ← r^2
+          r[l] = r[l] - truncReal(r[l]/k[l])*k[l]; // r ← r mod k
+        }
+      }
+    }
+  }
+
+// Double-double residue r x b mod m. The residues are integers below 2^50 so each fits in a single double, the product is
+// split exactly into two doubles with an FMA and reduced with the reciprocal of m, much like the vector kernels
+static inline double mulModDD(double a, double b, double m, double minv)
+{
+  STRICT_FP_BODY
+  double p = strictFp(a * b);
+  double e = std::fma(a, b, -p);
+  double q = std::floor(p * minv);
+  double x = std::fma(-q, m, p) + e; // Exact, the true remainder plus at most a couple of m
+  while (x < 0) {x = x + m;}
+  while (x >= m) {x = x - m;}
+  return x;
+}
+
+template <> void expoMod<DoubleDouble>(int64_t n, const DoubleDouble *k, DoubleDouble *r)
+  {
+    double m[4],minv[4],x[4];
+    for (int l = 0; l < 4; l++) {m[l] = k[l].hi; minv[l] = 1.0/m[l]; x[l] = 1;}
+    for (int b = 63 - __builtin_clzll(n); b >= 0; b--) // Left-Right binary, from the top bit of n down
+    {
+      for (int l = 0; l < 4; l++) {x[l] = mulModDD(x[l], x[l], m[l], minv[l]);} // r ← r^2 mod k
+      if ((n >> b) & 1)
+      {
+        for (int l = 0; l < 4; l++) {x[l] = mulModDD(x[l], 16.0, m[l], minv[l]);} // r ← br mod k
       }
     }
-    return r;
+    for (int l = 0; l < 4; l++) {r[l] = DoubleDouble(x[l]);}
+  }
+
+// Left Portion terms from k up to (but not including) kend for all four series, added into s[4]
+template <typename Real> KERNEL_CLONES void leftPortionTermsScalar(Real *s, int64_t k, int64_t kend, int64_t d)
+{
+  Real numerator[4],denominator[4];
+  for (;k < kend;k++)
+  {
+    for (int l = 0; l < 4; l++) {denominator[l] = Real(8 * k + seriesJ[l]);}
+    expoMod(d - k, denominator, numerator); // Binary algorithm for exponentiation with Modulo must be used becuase otherwise 16^(d-k) can be very large and overflows
+    for (int l = 0; l < 4; l++) {fracAdd(s[l], numerator[l]/denominator[l]);}
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// r mod k for four lanes, using the reciprocal of k so there is no divide. The FMA gives r - q*k exactly,
+// then a single correction step fixes the lanes where the rounded quotient was one out
+__attribute__((target("avx2,fma"))) static inline __m256d modReduceAVX2(__m256d r, __m256d k, __m256d kinv)
+{
+  __m256d q = _mm256_floor_pd(_mm256_mul_pd(r, kinv));
+  r = _mm256_fnmadd_pd(q, k, r);
+  r = _mm256_blendv_pd(r, _mm256_add_pd(r, k), _mm256_cmp_pd(r, _mm256_setzero_pd(), _CMP_LT_OQ));
+  r = _mm256_blendv_pd(r, _mm256_sub_pd(r, k), _mm256_cmp_pd(r, k, _CMP_GE_OQ));
+  return r;
+}
+
+// AVX2 Left Portion, the four series of one term are the four lanes so every lane has the same exponent
+__attribute__((target("avx2,fma"))) void leftPortionTermsAVX2(double *s, int64_t k, int64_t kend, int64_t d)
+{
+  const __m256d sixteen = _mm256_set1_pd(16.0);
+  const __m256d j = _mm256_setr_pd(seriesJ[0], seriesJ[1], seriesJ[2], seriesJ[3]);
+  __m256d acc = _mm256_loadu_pd(s);
+  for (;k < kend;k++)
+  {
+    __m256d denominator = _mm256_add_pd(_mm256_set1_pd(8.0 * k), j);
+    __m256d kinv = _mm256_div_pd(_mm256_set1_pd(1.0), denominator);
+    int64_t n = d - k;
+    __m256d r = _mm256_set1_pd(1.0);
+    for (int b = 63 - __builtin_clzll(n); b >= 0; b--) // Left-Right binary, from the top bit of n down
+    {
+      r = modReduceAVX2(_mm256_mul_pd(r, r), denominator, kinv); // r ← r^2 mod k, the first square is of 1 so is harmless
+      if ((n >> b) & 1) {r = modReduceAVX2(_mm256_mul_pd(r, sixteen), denominator, kinv);} // r ← br mod k
+    }
+    acc = _mm256_add_pd(acc, _mm256_div_pd(r, denominator));
+    acc = _mm256_sub_pd(acc, _mm256_floor_pd(acc));
   }
+  _mm256_storeu_pd(s, acc);
+}
+
+__attribute__((target("avx512f"))) static inline __m512d modReduceAVX512(__m512d r, __m512d k, __m512d kinv)
+{
+  __m512d q = _mm512_roundscale_pd(_mm512_mul_pd(r, kinv), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+  r = _mm512_fnmadd_pd(q, k, r);
+  r = _mm512_mask_add_pd(r, _mm512_cmp_pd_mask(r, _mm512_setzero_pd(), _CMP_LT_OQ), r, k);
+  r = _mm512_mask_sub_pd(r, _mm512_cmp_pd_mask(r, k, _CMP_GE_OQ), r, k);
+  return r;
+}
 
-// Left Portion for one thread - just does one term
-void leftPortionThreaded(double *threadResult, int k, int j, int d)
+// AVX-512 Left Portion, two consecutive terms per vector: lanes 0-3 are the four series for k, lanes 4-7 for k+1
+// The exponents of the two halves differ by one, so the multiply step is masked per lane by the bits of each exponent
+__attribute__((target("avx512f"))) void leftPortionTermsAVX512(double *s, int64_t k, int64_t kend, int64_t d)
 {
-  int kinit = k;
-  double s = 0;
-  for (;k < (kinit+100000);k++)
+  const __m512d sixteen = _mm512_set1_pd(16.0);
+  const __m512d j = _mm512_setr_pd(seriesJ[0], seriesJ[1], seriesJ[2], seriesJ[3], 8.0 + seriesJ[0], 8.0 + seriesJ[1], 8.0 + seriesJ[2], 8.0 + seriesJ[3]);
+  __m512d acc = _mm512_setzero_pd();
+  for (;k + 1 < kend;k += 2)
+  {
+    __m512d denominator = _mm512_add_pd(_mm512_set1_pd(8.0 * k), j);
+    __m512d kinv = _mm512_div_pd(_mm512_set1_pd(1.0), denominator);
+    int64_t n = d - k;
+    __m512i exponent = _mm512_setr_epi64(n, n, n, n, n - 1, n - 1, n - 1, n - 1);
+    __m512d r = _mm512_set1_pd(1.0);
+    for (int b = 63 - __builtin_clzll(n); b >= 0; b--)
+    {
+      r = modReduceAVX512(_mm512_mul_pd(r, r), denominator, kinv);
+      __mmask8 multiply = _mm512_test_epi64_mask(exponent, _mm512_set1_epi64(1LL << b));
+      if (multiply) {r = _mm512_mask_mov_pd(r, multiply, modReduceAVX512(_mm512_mul_pd(r, sixteen), denominator, kinv));}
+    }
+    acc = _mm512_add_pd(acc, _mm512_div_pd(r, denominator));
+    acc = _mm512_sub_pd(acc, _mm512_roundscale_pd(acc, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC));
+  }
+  double lanes[8];
+  _mm512_storeu_pd(lanes, acc);
+  for (int l = 0; l < 4; l++) // Fold the k+1 half back onto the four series
   {
-    double numerator,denominator;
-    denominator = 8 * k + j;
-    numerator = expoMod(d - k, denominator); // Binary algorithm for exponentiation with Modulo must be used becuase otherwise 16^(d-k) can be very large and overflows
-    s = s + numerator/denominator;
-    s = s - std::floor(s);
+    s[l] = s[l] + lanes[l] + lanes[l+4];
+    s[l] = s[l] - std::floor(s[l]);
   }
-  *threadResult = s;
+  leftPortionTermsScalar<double>(s, k, kend, d); // Odd term left over, if any
+}
+#elif defined(__aarch64__)
+static inline float64x2_t modReduceNEON(float64x2_t r, float64x2_t k, float64x2_t kinv)
+{
+  float64x2_t q = vrndmq_f64(vmulq_f64(r, kinv));
+  r = vfmsq_f64(r, q, k); // r - q*k
+  r = vbslq_f64(vcltq_f64(r, vdupq_n_f64(0.0)), vaddq_f64(r, k), r);
+  r = vbslq_f64(vcgeq_f64(r, k), vsubq_f64(r, k), r);
+  return r;
 }
 
-// Bailey–Borwein–Plouffe Formula 16^d x Sj
-double bbpf16jsd(int j, int d)
+// NEON Left Portion, the four series are held in two vectors of two lanes
+void leftPortionTermsNEON(double *s, int64_t k, int64_t kend, int64_t d)
+{
+  const float64x2_t sixteen = vdupq_n_f64(16.0);
+  const float64x2_t jlo = {static_cast<double>(seriesJ[0]), static_cast<double>(seriesJ[1])};
+  const float64x2_t jhi = {static_cast<double>(seriesJ[2]), static_cast<double>(seriesJ[3])};
+  float64x2_t acclo = vld1q_f64(s), acchi = vld1q_f64(s + 2);
+  for (;k < kend;k++)
   {
-    double s = .0;
-    double numerator,denominator;
-    double term;
-    std::thread *threadArray = new std::thread[noOfThreads]; // Array with the number of threads avalible
-    double *threadResults = new double[noOfThreads]; // For storing results from threads
-    // Left Portion
-    int k = 0;
-    while (k < d)
+    float64x2_t denlo = vaddq_f64(vdupq_n_f64(8.0 * k), jlo), denhi = vaddq_f64(vdupq_n_f64(8.0 * k), jhi);
+    float64x2_t kinvlo = vdivq_f64(vdupq_n_f64(1.0), denlo), kinvhi = vdivq_f64(vdupq_n_f64(1.0), denhi);
+    int64_t n = d - k;
+    float64x2_t rlo = vdupq_n_f64(1.0), rhi = rlo;
+    for (int b = 63 - __builtin_clzll(n); b >= 0; b--)
     {
-      if (k + (100000*noOfThreads) < d) // Only make threads for k up to less than d
-      {
-        for (uint i1 = 0; i1 < noOfThreads;i1++) // Create and execute (noOfThreads) threads
-        {
-          threadArray[i1] = std::thread(leftPortionThreaded,&threadResults[i1],k,j,d);
-          k = k + 100000; // We need to run 100000 result on each thread because the thread overhead is much to great to run just 1
-        }
-        for (int i2 = noOfThreads-1; i2 > -1;i2--) // Fetch results from all threads - count backwards because last thread executed will be slowest (higher numbers)
-        {
-          threadArray[i2].join();
-          s = s + threadResults[i2];
-          s = s - static_cast<int>(s);
-        }
-      } else // If we are almost done and k + noOfThreads > d then do the last few terms single threaded
+      rlo = modReduceNEON(vmulq_f64(rlo, rlo), denlo, kinvlo);
+      rhi = modReduceNEON(vmulq_f64(rhi, rhi), denhi, kinvhi);
+      if ((n >> b) & 1)
       {
-        denominator = 8 * k + j;
-        numerator = expoMod(d - k, denominator); // Binary algorithm for exponentiation with Modulo must be used becuase otherwise 16^(d-k) can be very large and overflows
-        term = numerator/denominator;
-        s = s + term;
-        s = s - static_cast<int>(s);
-        k++;
+        rlo = modReduceNEON(vmulq_f64(rlo, sixteen), denlo, kinvlo);
+        rhi = modReduceNEON(vmulq_f64(rhi, sixteen), denhi, kinvhi);
       }
     }
-    // Right Portion
-    for (int k = d; k <= d+100; k++)
+    acclo = vaddq_f64(acclo, vdivq_f64(rlo, denlo));
+    acchi = vaddq_f64(acchi, vdivq_f64(rhi, denhi));
+    acclo = vsubq_f64(acclo, vrndmq_f64(acclo));
+    acchi = vsubq_f64(acchi, vrndmq_f64(acchi));
+  }
+  vst1q_f64(s, acclo);
+  vst1q_f64(s + 2, acchi);
+}
+#endif
+
+// Integer backend - 16^n mod k is done exactly in 64-bit integers with Montgomery multiplication, so it is not limited by
+// the 53-bit mantissa of a double. Only the final r/k fraction is done in floating point.
+// Montgomery needs an odd modulus, 8k+4 and 8k+6 are even so their factors of two are taken out first: as 4n is always
+// larger than the number of twos, 16^n/(2^t m) has the same fractional part as (16^n 2^-t mod m)/m for odd m
+struct Montgomery
+{
+  uint64_t m; // Odd modulus, must be less than 2^63
+  uint64_t minv; // -m^-1 mod 2^64
+  uint64_t one; // R mod m, R = 2^64
+  uint64_t sixteen; // 16R mod m
+};
+
+static inline void montSetup(Montgomery &mont, uint64_t m)
+{
+  uint64_t inv = m; // Correct to 3 bits for any odd m, each Newton step doubles that
+  for (int i = 0; i < 5; i++) {inv = inv * (2 - m * inv);}
+  mont.m = m;
+  mont.minv = 0 - inv;
+  mont.one = (0 - m) % m;
+  mont.sixteen = mont.one;
+  for (int i = 0; i < 4; i++) // Four modular doublings
+  {
+    mont.sixteen = mont.sixteen << 1;
+    if (mont.sixteen >= m) {mont.sixteen = mont.sixteen - m;}
+  }
+}
+
+// a x b x R^-1 mod m
+static inline uint64_t montMul(uint64_t a, uint64_t b, const Montgomery &mont)
+{
+  unsigned __int128 t = static_cast<unsigned __int128>(a) * b;
+  uint64_t u = static_cast<uint64_t>(t) * mont.minv;
+  uint64_t r = static_cast<uint64_t>((t + static_cast<unsigned __int128>(u) * mont.m) >> 64); // Low half is zero by construction
+  return r >= mont.m ? r - mont.m : r;
+}
+
+// 16^n mod k for the four denominators of one term, the four Montgomery chains are independent so they overlap in the pipeline.
+// Returns the residues and the odd part of each denominator, r[l]/m[l] is the fractional part of 16^n/k[l]
+KERNEL_CLONES void expoModInt(int64_t n, const uint64_t *k, uint64_t *r, uint64_t *m)
+{
+  Montgomery mont[4];
+  int twos[4];
+  for (int l = 0; l < 4; l++)
+  {
+    twos[l] = __builtin_ctzll(k[l]);
+    m[l] = k[l] >> twos[l];
+    montSetup(mont[l], m[l]);
+    r[l] = mont[l].one;
+  }
+  for (int b = 63 - __builtin_clzll(n); b >= 0; b--) // Left-Right binary, from the top bit of n down
+  {
+    for (int l = 0; l < 4; l++) {r[l] = montMul(r[l], r[l], mont[l]);} // r ← r^2 mod k
+    if ((n >> b) & 1)
     {
-      numerator = pow(16, d - k);
-      denominator = 8 * k + j;
-      term = numerator/denominator;
-      if (term<1e-17) {break;}
-      s = s + term;
-      s = s - static_cast<int>(s);
+      for (int l = 0; l < 4; l++) {r[l] = montMul(r[l], mont[l].sixteen, mont[l]);} // r ← br mod k
     }
-    return s;
   }
+  for (int l = 0; l < 4; l++)
+  {
+    r[l] = montMul(r[l], 1, mont[l]); // Out of Montgomery form
+    for (int i = 0; i < twos[l]; i++) {r[l] = (r[l] & 1) ? (r[l] + m[l]) >> 1 : r[l] >> 1;} // r ← r/2 mod m
+    if (m[l] == 1) {r[l] = 0;} // 16^n is a multiple of k
+  }
+}
 
-// Bailey–Borwein–Plouffe Formula Calculation
-void bbpfCalc(double *pidec,int *place)
+template <typename Real> KERNEL_CLONES void leftPortionTermsInt(Real *s, int64_t k, int64_t kend, int64_t d)
+{
+  uint64_t denominator[4],numerator[4],oddDenominator[4];
+  for (;k < kend;k++)
   {
-    int tempn = *place;
-    double result;
-    result = (4.*bbpf16jsd(1,tempn))-(2.*bbpf16jsd(4,tempn))-bbpf16jsd(5,tempn)-bbpf16jsd(6,tempn);
-    result = result - static_cast<int>(result) + 1.;
-    *pidec = result;
+    for (int l = 0; l < 4; l++) {denominator[l] = 8 * k + seriesJ[l];}
+    expoModInt(d - k, denominator, numerator, oddDenominator);
+    for (int l = 0; l < 4; l++) {fracAdd(s[l], fraction<Real>(numerator[l], oddDenominator[l]));}
   }
+}
 
-void toHex(char *out, double *in)
+// 16^n in Montgomery form, for a single modulus
+static inline uint64_t montPow16(int64_t n, const Montgomery &mont)
 {
-  char hexNumbers[] = "0123456789ABCDEF";
+  uint64_t r = mont.one;
+  for (int b = 63 - __builtin_clzll(n); b >= 0; b--)
+  {
+    r = montMul(r, r, mont);
+    if ((n >> b) & 1) {r = montMul(r, mont.sixteen, mont);}
+  }
+  return r;
+}
 
-  for (int i = 0; i <= 8;i++)
+// Range Left Portion, adds the terms k up to kend for (count) positions d, d+stride, d+2stride... into s[4 x count].
+// Only the first position a term belongs to needs a full exponentiation, the residue for each position after that is the
+// last one times 16^stride, which is a single Montgomery multiply
+template <typename Real> KERNEL_CLONES void leftPortionRangeInt(Real *s, int64_t k, int64_t kend, int64_t d, int64_t stride, int64_t count)
+{
+  Montgomery mont[4];
+  int twos[4];
+  uint64_t x[4],step[4];
+  for (;k < kend;k++)
   {
-    *in = 16.0 * (*in - std::floor(*in));
-    out[i] = hexNumbers[static_cast<int>(*in)];
+    int64_t first = k < d ? 0 : (k - d)/stride + 1; // Terms at or past d are only in the left portion of later positions
+    if (first >= count) {return;}
+    for (int l = 0; l < 4; l++)
+    {
+      uint64_t denominator = 8 * k + seriesJ[l];
+      twos[l] = __builtin_ctzll(denominator);
+      montSetup(mont[l], denominator >> twos[l]);
+      x[l] = montPow16(d + first*stride - k, mont[l]);
+      step[l] = montPow16(stride, mont[l]);
+    }
+    for (int64_t p = first; p < count; p++)
+    {
+      for (int l = 0; l < 4; l++)
+      {
+        uint64_t r = montMul(x[l], 1, mont[l]); // Out of Montgomery form
+        for (int i = 0; i < twos[l]; i++) {r = (r & 1) ? (r + mont[l].m) >> 1 : r >> 1;} // r ← r/2 mod m
+        if (mont[l].m != 1) {fracAdd(s[p*4+l], fraction<Real>(r, mont[l].m));}
+        x[l] = montMul(x[l], step[l], mont[l]); // 16^(d_p - k) → 16^(d_p+1 - k)
+      }
+    }
   }
 }
 
-int main(int argc, char *argv[]) {
-  std::cout << "Bailey–Borwein–Plouffe Formula for Pi" << std::endl;
-  std::cout << "Built: " << __DATE__ << " " << __TIME__ << std::endl << std::endl;
-  int placeNo = (argc >= 2) && (std::atoi(argv[1]) > 0) ? std::atoi(argv[1]) - 1 : 10000000 - 1; // Accurate to 10000000
-  noOfThreads = (argc >= 3) && (std::atoi(argv[2]) > 0) ? static_cast<uint>(std::atoi(argv[2])) : std::thread::hardware_concurrency();
-  std::cout << "Calculating Position: " << (placeNo + 1) << ", Using " << noOfThreads << " CPU Threads" << std::endl;
-  double piArr;
-  bbpfCalc(&piArr, &placeNo);
-  char hexOutput[] = "000000000";
-  toHex(hexOutput, &piArr);
-  std::cout << "Pi Estimation Hex: " << hexOutput << std::endl;
+// A Left Portion kernel adds the terms k up to (but not including) kend of all four series into s[4]
+template <typename Real> using LeftPortionKernel = void (*)(Real *s, int64_t k, int64_t kend, int64_t d);
+
+// Backend "fp" uses expoMod in the arithmetic type itself, "int" the Montgomery engine, "auto" picks by position.
+// Only double has vector kernels, for the wider types the integer engine is quicker. The fixed point accumulators only have the integer backend
+template <typename Real> LeftPortionKernel<Real> selectKernel(const std::string &backend, int64_t d, const char **kernelName)
+{
+  (void)d;
+  if (backend == "fp") {*kernelName = "Scalar"; return leftPortionTermsScalar<Real>;}
+  *kernelName = "Integer Montgomery";
+  return leftPortionTermsInt<Real>;
+}
+
+template <> LeftPortionKernel<Fixed64> selectKernel<Fixed64>(const std::string &backend, int64_t d, const char **kernelName)
+{
+  (void)d;
+  *kernelName = "Integer Montgomery";
+  return backend == "fp" ? nullptr : leftPortionTermsInt<Fixed64>;
+}
+
+template <> LeftPortionKernel<Fixed128> selectKernel<Fixed128>(const std::string &backend, int64_t d, const char **kernelName)
+{
+  (void)d;
+  *kernelName = "Integer Montgomery";
+  return backend == "fp" ? nullptr : leftPortionTermsInt<Fixed128>;
+}
+
+template <> LeftPortionKernel<double> selectKernel<double>(const std::string &backend, int64_t d, const char **kernelName)
+{
+  if (backend == "int" || (backend == "auto" && d >= 10000000))
+  {
+    *kernelName = "Integer Montgomery";
+    return leftPortionTermsInt<double>;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {*kernelName = "AVX-512"; return leftPortionTermsAVX512;}
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {*kernelName = "AVX2"; return leftPortionTermsAVX2;}
+#elif defined(__aarch64__)
+  *kernelName = "NEON"; return leftPortionTermsNEON; // Always present on AArch64
+#endif
+  *kernelName = "Scalar";
+  return leftPortionTermsScalar<double>;
+}
+
+// Guided scheduling - the Left Portion is cut into blocks whose size depends only on d, so the sums and checkpoints are the
+// same whatever runs them. One task per worker claims runs of blocks from a shared counter, each claim takes a share of
+// what is left so the runs shrink toward the end, but never below what the worker does in chunkSeconds at its measured rate
+const double chunkSeconds = 0.002;
+
+int64_t blockTerms(int64_t d)
+{
+  return std::min<int64_t>(std::max<int64_t>(d / 1000, 100), 100000) / 100 * 100; // About a thousand blocks, so small positions still give every core work
+}
+
+// [kstart, kend) is cut into blocks of blockTerms(d) counted from kstart, the last one takes what's left over. It's claimed
+// last, so the few terms that don't make a whole block run alongside the other workers' last blocks instead of after them.
+// Block b starts at blockStart(b) and ends where block b+1 starts
+int64_t blockCount(int64_t kstart, int64_t kend, int64_t d)
+{
+  return (kend - kstart + blockTerms(d) - 1) / blockTerms(d);
+}
+
+int64_t blockStart(int64_t kstart, int64_t kend, int64_t d, int64_t b)
+{
+  return std::min(kstart + b*blockTerms(d), kend);
+}
+
+// Submit tasks that call runBlock(b) for every b in [0, blocks), the caller waits on the group
+template <typename Block> void runGuided(TaskGroup &group, std::atomic<int64_t> &next, int64_t blocks, Block runBlock)
+{
+  int64_t workers = std::min<int64_t>(workerPool->size(), blocks);
+  next.store(0);
+  for (int64_t w = 0; w < workers; w++)
+  {
+    workerPool->submit(group, [&next, blocks, workers, runBlock]()
+    {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      int64_t minChunk = 1, done = 0;
+      int64_t first = next.load(std::memory_order_relaxed);
+      while (true)
+      {
+        int64_t chunk;
+        do
+        {
+          if (first >= blocks) {return;}
+          chunk = std::min(std::max(minChunk, (blocks - first) / (2*workers)), blocks - first);
+        } while (!next.compare_exchange_weak(first, first + chunk, std::memory_order_relaxed));
+        for (int64_t b = first; b < first + chunk; b++) {runBlock(b);}
+        done = done + chunk;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (seconds > 0) {minChunk = std::max<int64_t>(static_cast<int64_t>(done * chunkSeconds / seconds), 1);} // Blocks per chunkSeconds
+        first = next.load(std::memory_order_relaxed);
+      }
+    });
+  }
+}
+
+template <typename Real> const char *precisionName();
+template <> const char *precisionName<double>() { return "double"; }
+template <> const char *precisionName<long double>() { return "long-double"; }
+template <> const char *precisionName<DoubleDouble>() { return "double-double"; }
+template <> const char *precisionName<__float128>() { return "float128"; }
+template <> const char *precisionName<Fixed64>() { return "fixed64"; }
+template <> const char *precisionName<Fixed128>() { return "fixed128"; }
+
+// Four partial sums as the hex of their bytes, so they can be written out and read back exactly
+template <typename Real> std::string toBytes(const Real *s)
+{
+  const char hexNumbers[] = "0123456789ABCDEF";
+  unsigned char bytes[4*sizeof(Real)];
+  std::memcpy(bytes, s, sizeof(bytes));
+  std::string out;
+  for (size_t i = 0; i < sizeof(bytes); i++) {out.push_back(hexNumbers[bytes[i] >> 4]); out.push_back(hexNumbers[bytes[i] & 15]);}
+  return out;
+}
+
+template <typename Real> bool fromBytes(const std::string &in, Real *s)
+{
+  unsigned char bytes[4*sizeof(Real)];
+  if (in.size() != 2*sizeof(bytes)) {return false;}
+  for (size_t i = 0; i < sizeof(bytes); i++)
+  {
+    char *end;
+    std::string pair = in.substr(2*i, 2);
+    bytes[i] = static_cast<unsigned char>(std::strtoul(pair.c_str(), &end, 16));
+    if (*end != '\0') {return false;}
+  }
+  std::memcpy(s, bytes, sizeof(bytes));
+  return true;
+}
+
+// Checkpoints - while a long Left Portion runs the finished blocks are written out every (interval) seconds, so a run that
+// is stopped can carry on from them with --resume. Each block's sums are kept separately and are still added in order,
+// so a resumed run gives exactly the same result
+struct Checkpoint
+{
+  std::string path; // Only set for single positions
+  double interval = 60;
+  bool resume = false;
+  std::string kernel, accumulator; // What the sums were made with, a checkpoint only resumes with the same ones
+};
+Checkpoint checkpoint;
+
+template <typename Real> void saveCheckpoint(int64_t d, int64_t kstart, int64_t kend, const std::vector<Real> &threadResults, const std::vector<std::atomic<bool>> &done)
+{
+  std::string temporary = checkpoint.path + ".tmp"; // Renamed over the last one, so there is always a whole checkpoint to resume from
+  {
+    std::ofstream file(temporary);
+    file << "bbp-pi-parallel-checkpoint 2" << std::endl;
+    file << checkpoint.kernel << std::endl; // On its own line, as the names have spaces
+    file << precisionName<Real>() << " " << checkpoint.accumulator << " " << d << " " << kstart << " " << kend << " " << done.size() << std::endl;
+    for (size_t i = 0; i < done.size(); i++)
+    {
+      if (done[i].load(std::memory_order_acquire)) {file << i << " " << toBytes(&threadResults[i*4]) << std::endl;}
+    }
+    if (!file) {std::cerr << "Can't write checkpoint " << temporary << std::endl; return;}
+  }
+  if (std::rename(temporary.c_str(), checkpoint.path.c_str()) != 0) {std::cerr << "Can't write checkpoint " << checkpoint.path << std::endl;}
+}
+
+// Fill in the blocks finished by an earlier run, a checkpoint for a different calculation is ignored
+template <typename Real> void loadCheckpoint(int64_t d, int64_t kstart, int64_t kend, std::vector<Real> &threadResults, std::vector<std::atomic<bool>> &done)
+{
+  std::ifstream file(checkpoint.path);
+  std::string header, kernel, precision, accumulator;
+  int64_t dc, kstartc, kendc;
+  size_t slices;
+  if (!std::getline(file, header) || header != "bbp-pi-parallel-checkpoint 2" || !std::getline(file, kernel)
+      || !(file >> precision >> accumulator >> dc >> kstartc >> kendc >> slices) || kernel != checkpoint.kernel
+      || precision != precisionName<Real>() || accumulator != checkpoint.accumulator || dc != d || kstartc != kstart || kendc != kend || slices != done.size())
+  {
+    std::cerr << "No checkpoint for this calculation in " << checkpoint.path << ", starting from the beginning" << std::endl;
+    return;
+  }
+  size_t loaded = 0;
+  size_t i;
+  for (std::string bytes; file >> i >> bytes;)
+  {
+    if (i < slices && fromBytes(bytes, &threadResults[i*4])) {done[i].store(true); loaded++;}
+  }
+  progress.count(workerIndex, static_cast<int64_t>(loaded) * (kend - kstart) / std::max<int64_t>(slices, 1)); // Near enough for progress
+  std::cout << "Resuming: " << loaded << " of " << slices << " blocks already done" << std::endl;
+}
+
+// Left Portion over [kstart, kend). The range is cut into blocks (see blockStart), each worker adds the blocks it does into
+// its own cache line and those are combined once at the end. The sums are exact (see toFixed128) so the
+// result for a range is the same bit for bit however many threads or nodes run it
+template <typename Real> void leftPortion(Real *s, int64_t kstart, int64_t kend, int64_t d, LeftPortionKernel<Real> leftPortionTerms)
+{
+  int64_t blocks = blockCount(kstart, kend, d);
+  SeriesSums total = {};
+  TaskGroup blockTasks;
+  std::atomic<int64_t> next(0);
+  if (checkpoint.path.empty())
+  {
+    SeriesSums *workerSums = static_cast<SeriesSums *>(workerPool->acquireLines());
+    runGuided(blockTasks, next, blocks, [workerSums, kstart, kend, blocks, d, leftPortionTerms](int64_t b)
+    {
+      Real part[4] = {};
+      int64_t k = blockStart(kstart, kend, d, b), kblockEnd = blockStart(kstart, kend, d, b + 1);
+      leftPortionTerms(part, k, kblockEnd, d);
+      addSums(workerSums[workerIndex], part);
+      progress.count(workerIndex, kblockEnd - k);
+    });
+    workerPool->wait(blockTasks);
+    profiler.phase(phaseLeft);
+    for (uint w = 0; w <= workerPool->size(); w++) {addSums(total, workerSums[w].s);}
+    workerPool->releaseLines(workerSums);
+  }
+  else // Checkpoints need each block's own sums, to write out which ones are done
+  {
+    std::vector<Real> threadResults(blocks*4); // For storing results from each block, four series per block
+    std::vector<std::atomic<bool>> done(blocks); // Which blocks have finished
+    if (checkpoint.resume) {loadCheckpoint(d, kstart, kend, threadResults, done);}
+    runGuided(blockTasks, next, blocks, [&threadResults, &done, kstart, kend, blocks, d, leftPortionTerms](int64_t b)
+    {
+      if (done[b].load(std::memory_order_relaxed)) {return;}
+      Real part[4] = {};
+      int64_t k = blockStart(kstart, kend, d, b), kblockEnd = blockStart(kstart, kend, d, b + 1);
+      leftPortionTerms(part, k, kblockEnd, d);
+      for (int l = 0; l < 4; l++) {threadResults[b*4+l] = part[l];}
+      done[b].store(true, std::memory_order_release);
+      progress.count(workerIndex, kblockEnd - k);
+    });
+    while (!workerPool->waitFor(blockTasks, checkpoint.interval)) {saveCheckpoint(d, kstart, kend, threadResults, done);}
+    saveCheckpoint(d, kstart, kend, threadResults, done);
+    profiler.phase(phaseLeft);
+    for (int64_t i2 = 0; i2 < blocks; i2++) {addSums(total, &threadResults[i2*4]);}
+  }
+  for (int l = 0; l < 4; l++) {fracAdd(s[l], fromFixed128<Real>(total.s[l]));}
+}
+
+// Distributed mode - nodes are other copies of the program run with --worker=PORT, the coordinator splits the Left Portion
+// between itself and the nodes by their thread counts. Messages are single text lines, the partial sums are sent with toBytes
+// so they arrive exactly, which assumes every node has the same architecture
+struct Cluster
+{
+  std::vector<std::string> nodes; // host:port of each worker
+  std::string backend = "auto"; // Sent with each job so the workers choose the same kernel
+};
+Cluster cluster;
+
+// Connect to host:port, returns the socket or -1
+int connectNode(const std::string &node)
+{
+  size_t colon = node.rfind(':');
+  if (colon == std::string::npos) {return -1;}
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *addresses;
+  if (getaddrinfo(node.substr(0, colon).c_str(), node.substr(colon + 1).c_str(), &hints, &addresses) != 0) {return -1;}
+  int fd = -1;
+  for (addrinfo *a = addresses; a != nullptr && fd < 0; a = a->ai_next)
+  {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {close(fd); fd = -1;}
+  }
+  freeaddrinfo(addresses);
+  return fd;
+}
+
+bool sendLine(int fd, const std::string &line)
+{
+  std::string out = line + "\n";
+  for (size_t sent = 0; sent < out.size();)
+  {
+    ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0) {return false;}
+    sent = sent + n;
+  }
+  return true;
+}
+
+bool readLine(int fd, std::string &line)
+{
+  line.clear();
+  char c;
+  while (recv(fd, &c, 1, 0) == 1)
+  {
+    if (c == '\n') {return true;}
+    line.push_back(c);
+  }
+  return false;
+}
+
+// Left Portion over [0, d) shared between this process and the cluster's nodes. A node that can't be reached or fails has
+// its share done here instead
+template <typename Real> void leftPortionCluster(Real *s, int64_t d, LeftPortionKernel<Real> leftPortionTerms)
+{
+  std::vector<int> fds;
+  std::vector<uint> weights(1, noOfThreads); // This process is rank 0
+  for (size_t i = 0; i < cluster.nodes.size(); i++)
+  {
+    int fd = connectNode(cluster.nodes[i]);
+    std::string hello;
+    uint threads = 0;
+    if (fd >= 0 && readLine(fd, hello) && hello.compare(0, 17, "bbp-pi-parallel 1") == 0) {threads = std::atoi(hello.c_str() + 18);}
+    if (threads == 0)
+    {
+      std::cerr << "Node " << cluster.nodes[i] << " is unavailable" << std::endl;
+      if (fd >= 0) {close(fd);}
+      continue;
+    }
+    fds.push_back(fd);
+    weights.push_back(threads);
+  }
+  // Share [0, d) by thread count, with the boundaries on whole blocks
+  uint total = 0;
+  for (size_t r = 0; r < weights.size(); r++) {total = total + weights[r];}
+  std::vector<int64_t> bounds(1, 0);
+  uint share = 0;
+  for (size_t r = 0; r < weights.size(); r++)
+  {
+    share = share + weights[r];
+    bounds.push_back(r + 1 == weights.size() ? d : static_cast<int64_t>(static_cast<double>(d) * share / total) / blockTerms(d) * blockTerms(d));
+  }
+  for (size_t r = 1; r < weights.size(); r++)
+  {
+    std::ostringstream job;
+    job << "job " << precisionName<Real>() << " " << cluster.backend << " " << d << " " << bounds[r] << " " << bounds[r+1];
+    sendLine(fds[r-1], job.str());
+  }
+  leftPortion(s, bounds[0], bounds[1], d, leftPortionTerms);
+  for (size_t r = 1; r < weights.size(); r++) // Reduce in rank order, so the sum doesn't depend on which node finishes first
+  {
+    Real part[4] = {};
+    std::string reply;
+    bool ok = readLine(fds[r-1], reply) && reply.compare(0, 7, "result ") == 0 && fromBytes(reply.substr(7, 8*sizeof(Real)), part);
+    close(fds[r-1]);
+    if (!ok)
+    {
+      std::cerr << "Node " << r << " failed, doing its share locally" << std::endl;
+      leftPortion(part, bounds[r], bounds[r+1], d, leftPortionTerms);
+    }
+    else {progress.count(workerIndex, bounds[r+1] - bounds[r]);}
+    for (int l = 0; l < 4; l++) {fracAdd(s[l], part[l]);}
+  }
+}
+
+// Result cache - with --cache=FILE the four series sums 16^d x Sj of each position are kept by position and precision,
+// so a position asked for again, or again as part of a range, is read back instead of calculated. The file is a header
+// and then fixed size records, so it's mapped into memory as it is, and new results are appended as they finish.
+// The sums are the bytes of the accumulator type, so like the distributed mode a file is only for one architecture
+struct CacheHeader
+{
+  char magic[24]; // "bbp-pi-parallel-cache 1"
+  uint32_t recordSize;
+  uint32_t reserved;
+};
+
+struct CacheRecord
+{
+  int64_t d;
+  char precision[16]; // precisionName, zero padded
+  unsigned char sums[4][16]; // The four series, space for the widest type
+};
+
+class ResultCache
+{
+  public:
+    ~ResultCache()
+    {
+      if (mapped) {munmap(mapped, mappedSize);}
+      if (fd >= 0) {close(fd);}
+    }
+
+    // Open or create the file and index the records already in it, a file that isn't a cache is left alone.
+    // Several processes can share a file: records are only appended, with O_APPEND and under an exclusive flock, and a
+    // process that misses maps the file again for the records the others have added
+    bool open(const std::string &path)
+    {
+      fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+      if (fd < 0 || flock(fd, LOCK_EX) != 0) {std::cerr << "Can't open cache " << path << std::endl; closeFile(); return false;}
+      bool ok = prepare(path);
+      flock(fd, LOCK_UN);
+      if (!ok) {closeFile();}
+      return ok;
+    }
+
+    // Fill in sj if position d has been calculated before with this precision
+    template <typename Real> bool find(int64_t d, Real *sj)
+    {
+      if (fd < 0) {return false;}
+      std::lock_guard<std::mutex> lock(cacheMutex);
+      std::pair<int64_t, std::string> key(d, precisionName<Real>());
+      if (!index.count(key) && flock(fd, LOCK_SH) == 0) // Perhaps another process has done it since
+      {
+        remap();
+        flock(fd, LOCK_UN);
+      }
+      std::map<std::pair<int64_t, std::string>, const CacheRecord *>::const_iterator found = index.find(key);
+      if (found == index.end()) {return false;}
+      for (int l = 0; l < 4; l++) {std::memcpy(&sj[l], found->second->sums[l], sizeof(Real));}
+      return true;
+    }
+
+    template <typename Real> void store(int64_t d, const Real *sj)
+    {
+      static_assert(sizeof(Real) <= sizeof(CacheRecord().sums[0]), "Accumulator too wide for the cache");
+      if (fd < 0) {return;}
+      CacheRecord record = {};
+      record.d = d;
+      std::strncpy(record.precision, precisionName<Real>(), sizeof(record.precision) - 1);
+      for (int l = 0; l < 4; l++) {std::memcpy(record.sums[l], &sj[l], sizeof(Real));}
+      std::lock_guard<std::mutex> lock(cacheMutex);
+      std::pair<int64_t, std::string> key(d, record.precision);
+      if (index.count(key)) {return;}
+      if (flock(fd, LOCK_EX) != 0) {std::cerr << "Can't write to the cache" << std::endl; return;}
+      remap(); // Another process may have stored it meanwhile
+      struct stat info;
+      bool written = index.count(key) || (fstat(fd, &info) == 0 && dropPartial(info.st_size)
+                     && write(fd, &record, sizeof(record)) == static_cast<ssize_t>(sizeof(record)));
+      flock(fd, LOCK_UN);
+      if (!written) {std::cerr << "Can't write to the cache" << std::endl; return;}
+      if (index.count(key)) {return;}
+      added.push_back(record);
+      index[key] = &added.back();
+    }
+
+  private:
+    int fd = -1; // -1 while there's no cache
+    void *mapped = nullptr;
+    size_t mappedSize = 0;
+    std::mutex cacheMutex; // Guards the index, added and the mapping, batch mode looks up several positions at once
+    std::map<std::pair<int64_t, std::string>, const CacheRecord *> index; // Into the mapped file or added
+    std::deque<CacheRecord> added; // Records written since the file was mapped, a deque so they don't move
+
+    void closeFile()
+    {
+      if (fd >= 0) {close(fd);}
+      fd = -1;
+    }
+
+    // The header and the whole records of a file of this size
+    static size_t wholeSize(off_t size)
+    {
+      return sizeof(CacheHeader) + (static_cast<size_t>(size) - sizeof(CacheHeader)) / sizeof(CacheRecord) * sizeof(CacheRecord);
+    }
+
+    // Drop a record cut short by a process that crashed while appending it, with the exclusive lock held
+    bool dropPartial(off_t size) { return wholeSize(size) == static_cast<size_t>(size) || ftruncate(fd, wholeSize(size)) == 0; }
+
+    // With the exclusive lock held, write the header of a new file or check the header of an existing one
+    bool prepare(const std::string &path)
+    {
+      struct stat info;
+      if (fstat(fd, &info) != 0) {std::cerr << "Can't open cache " << path << std::endl; return false;}
+      CacheHeader header = {}, existing = {};
+      std::strncpy(header.magic, "bbp-pi-parallel-cache 1", sizeof(header.magic));
+      header.recordSize = sizeof(CacheRecord);
+      if (info.st_size == 0)
+      {
+        if (write(fd, &header, sizeof(header)) != static_cast<ssize_t>(sizeof(header))) {std::cerr << "Can't write cache " << path << std::endl; return false;}
+      }
+      else if (static_cast<size_t>(info.st_size) < sizeof(header) || pread(fd, &existing, sizeof(existing), 0) != static_cast<ssize_t>(sizeof(existing))
+               || std::memcmp(&existing, &header, sizeof(header)) != 0)
+      {
+        std::cerr << "Not a cache for this program: " << path << std::endl;
+        return false;
+      }
+      else if (!dropPartial(info.st_size)) {std::cerr << "Can't write cache " << path << std::endl; return false;}
+      remap();
+      return true;
+    }
+
+    // Map the file again if it has grown, and index its records. Needs a lock on the file, so no record is half written,
+    // and cacheMutex. Every record in added is in the file by now
+    void remap()
+    {
+      struct stat info;
+      if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(CacheHeader)) {return;}
+      size_t size = wholeSize(info.st_size);
+      if (size <= mappedSize) {return;}
+      void *file = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (file == MAP_FAILED) {return;}
+      if (mapped) {munmap(mapped, mappedSize);}
+      mapped = file;
+      mappedSize = size;
+      index.clear();
+      added.clear();
+      size_t records = (size - sizeof(CacheHeader)) / sizeof(CacheRecord);
+      const CacheRecord *record = reinterpret_cast<const CacheRecord *>(static_cast<char *>(file) + sizeof(CacheHeader));
+      for (size_t i = 0; i < records; i++)
+      {
+        index[std::make_pair(record[i].d, std::string(record[i].precision, strnlen(record[i].precision, sizeof(record[i].precision))))] = &record[i];
+      }
+    }
+};
+ResultCache resultCache;
+
+// Wall time of each phase of the last calculation, filled in when the benchmark sets phaseTimes. The four series are done
+// in one pass, so the times cover all of them
+struct PhaseTimes
+{
+  double left = 0, right = 0;
+};
+PhaseTimes *phaseTimes = nullptr;
+
+// Bailey–Borwein–Plouffe Formula 16^d x Sj, for j = 1,4,5,6 in a single pass over k
+template <typename Real> void bbpf16jsd(Real *sj, int64_t d, LeftPortionKernel<Real> leftPortionTerms)
+  {
+    Real s[4] = {};
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    profiler.start();
+    // Left Portion
+    if (cluster.nodes.empty()) {leftPortion(s, 0, d, d, leftPortionTerms);}
+    else {leftPortionCluster(s, d, leftPortionTerms);}
+    profiler.phase(phaseReduction); // From when leftPortion's own terms are done, so with nodes it includes the wait for them
+    std::chrono::steady_clock::time_point leftDone = std::chrono::steady_clock::now();
+    // Right Portion
+    rightPortion(s, d);
+    profiler.phase(phaseRight);
+    for (int l = 0; l < 4; l++) {sj[l] = s[l];}
+    if (phaseTimes)
+    {
+      phaseTimes->left = std::chrono::duration<double>(leftDone - start).count();
+      phaseTimes->right = std::chrono::duration<double>(std::chrono::steady_clock::now() - leftDone).count();
+    }
+  }
+
+// 16^d x Sj for the positions d, d+stride, ... d+(count-1)stride at once, sj holds four series per position
+template <typename Real> void bbpf16jsdRange(Real *sj, int64_t d, int64_t stride, int64_t count)
+  {
+    std::vector<Real> s(count*4);
+    int64_t dlast = d + (count-1)*stride;
+    // Left Portion, up to the last position
+    int64_t blocks = blockCount(0, dlast, d);
+    std::vector<Real> threadResults(blocks*count*4);
+    Real *results = threadResults.data();
+    TaskGroup blockTasks;
+    std::atomic<int64_t> next(0);
+    profiler.start();
+    runGuided(blockTasks, next, blocks, [results, dlast, blocks, d, stride, count](int64_t b)
+    {
+      int64_t k = blockStart(0, dlast, d, b), kblockEnd = blockStart(0, dlast, d, b + 1);
+      leftPortionRangeInt(results + b*count*4, k, kblockEnd, d, stride, count);
+      progress.count(workerIndex, kblockEnd - k);
+    });
+    workerPool->wait(blockTasks);
+    profiler.phase(phaseLeft);
+    for (int64_t i2 = 0; i2 < blocks; i2++)
+    {
+      for (int64_t i = 0; i < count*4; i++) {fracAdd(s[i], threadResults[i2*count*4+i]);}
+    }
+    profiler.phase(phaseReduction);
+    // Right Portion of each position
+    for (int64_t p = 0; p < count; p++) {rightPortion(&s[p*4], d + p*stride);}
+    profiler.phase(phaseRight);
+    for (int64_t i = 0; i < count*4; i++) {sj[i] = s[i];}
+  }
+
+// As bbpf16jsdRange, but positions at either end already in the result cache are read from it and the rest calculated
+template <typename Real> void bbpf16jsdRangeCached(Real *sj, int64_t d, int64_t stride, int64_t count)
+  {
+    int64_t first = 0, last = count;
+    while (first < last && resultCache.find(d + first*stride, &sj[first*4])) {first++;}
+    while (last > first && resultCache.find(d + (last-1)*stride, &sj[(last-1)*4])) {last--;}
+    int64_t calculated = 0;
+    if (first < last)
+    {
+      bbpf16jsdRange(&sj[first*4], d + first*stride, stride, last - first);
+      for (int64_t p = first; p < last; p++) {resultCache.store(d + p*stride, &sj[p*4]);}
+      calculated = d + (last-1)*stride;
+    }
+    progress.count(workerIndex, d + (count-1)*stride - calculated); // The terms that didn't need doing
+  }
+
+// Error bound - u is half an ulp of a sum in [1, 2), or the truncation of a fixed point fraction
+template <typename Real> static inline double roundoff() { return std::ldexp(1., -sumBits<Real>()); }
+template <> inline double roundoff<DoubleDouble>() { return std::ldexp(1., -104); } // Double-double operations are within a few ulps of 2^-106
+
+// The integer engine's residues are exact while 8d+6 is exact in the sum type, the floating point ones while the product of
+// two residues, up to (8d+6)^2, is. Past that the residues, and so every digit, can be wrong
+template <typename Real> static inline bool exactResidues(LeftPortionKernel<Real> leftPortionTerms, int64_t d)
+{
+  double k = 8.*d + 6;
+  if (leftPortionTerms == leftPortionTermsInt<Real>) {return k < std::ldexp(1., sumBits<Real>());}
+  return k*k < std::ldexp(1., sumBits<Real>());
+}
+template <> inline bool exactResidues<DoubleDouble>(LeftPortionKernel<DoubleDouble> leftPortionTerms, int64_t d)
+{
+  return leftPortionTerms == leftPortionTermsInt<DoubleDouble> || 8.*d < std::ldexp(1., 50); // As mulModDD
+}
+
+// Bound on how far the computed 16^d pi mod 1 is from the true value. Each Left Portion term of a series, d of them, and
+// each of the at most sumBits/4 + 2 Right Portion terms, is an exact residue divided by its denominator and added mod 1,
+// within 1.5u of exact (the fixed point types truncate the fraction and add exactly, within u). Partial sums are merged
+// (the AVX-512 fold, the Fixed128 block sums, nodes, the cache and back to the sum type) within 2u each, at most one per
+// hundred terms plus a few, and the omitted Right Portion tail is below 2u, so each series is within 2u(d + 16 more than
+// the Right Portion). 4S1 - 2S4 - S5 - S6 is within 8 times that, and its own rounding and the conversion to Fixed128
+// add under 16u
+template <typename Real> double errorBound(int64_t d, bool exact)
+{
+  if (!exact) {return 1.;}
+  double terms = d + sumBits<Real>()/4 + 2 + 16;
+  return (16*terms + 16)*roundoff<Real>();
+}
+
+// Leading hex digits of x, up to (digits), that every value within bound of it shares, so they're those of the true value
+int guaranteedDigits(Fixed128 x, double bound, int digits)
+{
+  if (!(bound < 1./16)) {return 0;}
+  Fixed128 e = toFixed128(bound);
+  e.v = e.v + 1; // toFixed128 truncates
+  unsigned __int128 low = x.v - e.v, high = x.v + e.v; // An interval that wraps past 0 differs in the first digit
+  int n = 0;
+  while (n < digits && n < 32 && (low >> (124 - 4*n)) == (high >> (124 - 4*n))) {n++;}
+  return n;
+}
+
+// Bailey–Borwein–Plouffe Formula Calculation, returns true if the result came from the cache
+// Only results with exact residues are cached, so a cached result is always covered by errorBound
+template <typename Real> bool bbpfCalc(Real *pidec,int64_t *place, LeftPortionKernel<Real> leftPortionTerms)
+  {
+    int64_t tempn = *place;
+    Real sj[4];
+    bool cached = resultCache.find(tempn, sj);
+    if (cached) {progress.count(workerIndex, tempn);}
+    else
+    {
+      bbpf16jsd(sj, tempn, leftPortionTerms);
+      if (exactResidues(leftPortionTerms, tempn)) {resultCache.store(tempn, sj);}
+    }
+    combineSeries(*pidec, sj);
+    return cached;
+  }
+
+// Verification - Bellard's formula, pi = 2^-6 Sum (-1)^n 2^-10n (-2^5/(4n+1) - 1/(4n+3) + 2^8/(10n+1) - 2^6/(10n+3)
+// - 2^2/(10n+5) - 2^2/(10n+7) + 1/(10n+9)), gives 16^d pi mod 1 from a different set of sums. Each term of 2^(4d-6+a-10n)/m
+// is 2^e mod m over m while e >= 0 and 2^-e/m after that, done with the integer engine into a Fixed128 sum, so it needs
+// no more than about 0.4d terms of seven exponentiations each. Negative terms are added as (m - r)/m
+struct BellardTerm
+{
+  int a; // Power of two in the numerator
+  int scale, offset; // Denominator scale x n + offset
+  bool negative;
+};
+const BellardTerm bellardTerms[7] = {{5, 4, 1, true}, {0, 4, 3, true}, {8, 10, 1, false}, {6, 10, 3, true}, {2, 10, 5, true}, {2, 10, 7, true}, {0, 10, 9, false}};
+
+// One term 2^(4d-6+a-10n)/m mod 1 with its sign, for the last few n where its exponent may be negative
+static inline Fixed128 bellardTerm(const BellardTerm &term, int64_t n, int64_t d)
+{
+  uint64_t m = term.scale * n + term.offset;
+  int64_t e = 4 * d - 6 + term.a - 10 * n;
+  Fixed128 x = {0};
+  if (e >= 0)
+  {
+    Montgomery mont;
+    montSetup(mont, m);
+    uint64_t r = e >= 4 ? montMul(montPow16(e >> 2, mont), 1, mont) : 1 % m;
+    for (int i = 0; i < (e & 3); i++) {r = r << 1; if (r >= m) {r = r - m;}} // The last few doublings
+    x = fraction<Fixed128>(r, m);
+  }
+  else if (e > -128 && m == 1) {x.v = x.v + 1; x.v = x.v << (128 + e);} // 1 itself isn't representable
+  else if (e > -128) {x.v = fraction<Fixed128>(1, m).v >> -e;}
+  if (term.negative != (n % 2 == 1)) {x.v = 0 - x.v;}
+  return x;
+}
+
+// Adds the terms n up to nend into s. The seven exponents of one n only differ by their a, so while they are all positive
+// the seven moduli share the chain for 16^((4d-6-10n)/4), interleaved as in expoModInt, and each term's a and the
+// remainder of the shift are a few doublings after it
+KERNEL_CLONES static void bellardTerms16d(Fixed128 &s, int64_t n, int64_t nend, int64_t d)
+{
+  Montgomery mont[7];
+  uint64_t r[7];
+  for (;n < nend;n++)
+  {
+    int64_t e = 4 * d - 6 - 10 * n; // Exponent of the terms with a = 0
+    if (e < 4)
+    {
+      for (int c = 0; c < 7; c++) {s.v = s.v + bellardTerm(bellardTerms[c], n, d).v;}
+      continue;
+    }
+    for (int c = 0; c < 7; c++)
+    {
+      montSetup(mont[c], bellardTerms[c].scale * n + bellardTerms[c].offset);
+      r[c] = mont[c].one;
+    }
+    int64_t q = e >> 2;
+    for (int b = 63 - __builtin_clzll(q); b >= 0; b--) // Left-Right binary, as expoModInt
+    {
+      for (int c = 0; c < 7; c++) {r[c] = montMul(r[c], r[c], mont[c]);}
+      if ((q >> b) & 1)
+      {
+        for (int c = 0; c < 7; c++) {r[c] = montMul(r[c], mont[c].sixteen, mont[c]);}
+      }
+    }
+    bool odd = n % 2 == 1;
+    for (int c = 0; c < 7; c++)
+    {
+      uint64_t m = mont[c].m;
+      uint64_t x = montMul(r[c], 1, mont[c]); // Out of Montgomery form
+      for (int i = 0; i < (e & 3) + bellardTerms[c].a; i++) {x = x << 1; if (x >= m) {x = x - m;}}
+      Fixed128 f = fraction<Fixed128>(x, m);
+      if (bellardTerms[c].negative != odd) {f.v = 0 - f.v;}
+      s.v = s.v + f.v;
+    }
+  }
+}
+
+// Past this every term of Bellard's formula is below 2^-128
+int64_t bellardTermCount(int64_t d) { return (4 * d + 130) / 10 + 1; }
+
+// Each of the seven terms per n is truncated twice at most, and the omitted ones add up to less than 2^-127
+double bellardBound(int64_t d) { return (14.*bellardTermCount(d) + 4)*std::ldexp(1., -128); }
+
+// 16^d pi mod 1 by Bellard's formula, on the worker pool with the same guided blocks as the Left Portion
+Fixed128 bellard16d(int64_t d)
+{
+  int64_t nend = bellardTermCount(d);
+  int64_t blocks = blockCount(0, nend, d);
+  SeriesSums *workerSums = static_cast<SeriesSums *>(workerPool->acquireLines());
+  TaskGroup blockTasks;
+  std::atomic<int64_t> next(0);
+  runGuided(blockTasks, next, blocks, [workerSums, nend, d](int64_t b)
+  {
+    bellardTerms16d(workerSums[workerIndex].s[0], blockStart(0, nend, d, b), blockStart(0, nend, d, b + 1), d);
+  });
+  workerPool->wait(blockTasks);
+  Fixed128 sum = {0};
+  for (uint w = 0; w <= workerPool->size(); w++) {sum.v = sum.v + workerSums[w].s[0].v;}
+  workerPool->releaseLines(workerSums);
+  return sum;
+}
+
+template <typename Real> void toHex(char *out, Real *in, int digits = 9)
+{
+  char hexNumbers[] = "0123456789ABCDEF";
+
+  for (int i = 0; i < digits;i++)
+  {
+    *in = Real(16.0) * (*in - floorReal(*in));
+    out[i] = hexNumbers[truncInt(*in)];
+  }
+}
+
+// Fixed point digits are just the top nibbles
+void toHex(char *out, Fixed64 *in, int digits = 9)
+{
+  char hexNumbers[] = "0123456789ABCDEF";
+
+  for (int i = 0; i < digits;i++) {out[i] = hexNumbers[(in->v >> (60 - 4*i)) & 0xF];}
+}
+
+void toHex(char *out, Fixed128 *in, int digits = 9)
+{
+  char hexNumbers[] = "0123456789ABCDEF";
+
+  for (int i = 0; i < digits;i++) {out[i] = hexNumbers[static_cast<int>(in->v >> (124 - 4*i)) & 0xF];}
+}
+
+// Whether the error bound at position d covers all (digits) hex digits, with one to spare so that few positions fall close
+// enough to a digit boundary to lose the last
+template <typename Real> bool coversDigits(int64_t d, int digits) { return 2*errorBound<Real>(d, true)*std::pow(16., digits + 1) <= 1; }
+
+// Cheapest type whose error bound covers the nine digits at position d. The fp backend also needs (8d+6)^2 to be exact
+// in the mantissa, with the integer backend the exponentiation is exact and only the accumulated fractions are rounded
+std::string autoPrecision(const std::string &backend, int64_t d)
+{
+  bool longDouble64 = std::numeric_limits<long double>::digits >= 64; // 80-bit x87, on other platforms long double may just be double
+  bool fp = backend == "fp";
+  if ((!fp || d < 10000000) && coversDigits<double>(d, 9)) {return "double";}
+  if (longDouble64 && (!fp || d < 500000000) && coversDigits<long double>(d, 9)) {return "long-double";}
+  return "double-double"; // Covers nine digits to beyond 10^17, fp products are exact while 8d < 2^50
+}
+
+// Calculate one position with the given accumulator type, returns false if the backend can't be used with it
+// With verifyOutput set, Bellard's formula runs alongside on the same pool and its digits go there
+template <typename Real> bool calcPositionAs(int64_t placeNo, const std::string &backend, char *hexOutput, std::string &engine, char *verifyOutput)
+{
+  const char *kernelName;
+  LeftPortionKernel<Real> leftPortionTerms = selectKernel<Real>(backend, placeNo, &kernelName);
+  if (!leftPortionTerms) {return false;}
+  if (!checkpoint.path.empty()) {checkpoint.kernel = kernelName;} // Only for single positions, so nothing else is running
+  Fixed128 check;
+  std::thread verifier;
+  if (verifyOutput) {verifier = std::thread([&check, placeNo]() { check = bellard16d(placeNo); });}
+  Real piArr;
+  bool cached = bbpfCalc(&piArr, &placeNo, leftPortionTerms);
+  engine = std::string(cached ? "Result Cache" : kernelName) + ", Precision: " + precisionName<Real>();
+  int digits = guaranteedDigits(toFixed128(piArr), errorBound<Real>(placeNo, cached || exactResidues(leftPortionTerms, placeNo)), 9);
+  toHex(hexOutput, &piArr);
+  hexOutput[digits] = '\0'; // Only the digits the error bound guarantees
+  if (verifier.joinable())
+  {
+    verifier.join();
+    digits = guaranteedDigits(check, bellardBound(placeNo), 9);
+    toHex(verifyOutput, &check);
+    verifyOutput[digits] = '\0';
+  }
+  return true;
+}
+
+// Number of leading hex digits two results agree on, out of the (compared) that both have
+int agreeingDigits(const char *a, const char *b, int &compared)
+{
+  int n = 0;
+  while (a[n] != '\0' && a[n] == b[n]) {n++;}
+  compared = std::min(std::strlen(a), std::strlen(b));
+  return n;
+}
+
+// Why the options can't be used, empty if they can. Checked once where they come in, so an unknown name is an error rather
+// than a run in double
+std::string optionsError(const EngineOptions &options)
+{
+  const std::string &b = options.backend, &a = options.accumulator, &p = options.precision;
+  if (b != "auto" && b != "fp" && b != "int") {return "Unknown backend: " + b;}
+  if (a != "float" && a != "fixed64" && a != "fixed128") {return "Unknown accumulator: " + a;}
+  if (p != "auto" && p != "double" && p != "long-double" && p != "double-double" && p != "float128") {return "Unknown precision: " + p;}
+  return std::string();
+}
+
+// hexOutput gets the guaranteed digits of the nine at placeNo, which may be fewer with a low precision or none where the
+// residues aren't exact. verifyOutput is filled in the same way when options.verify is set
+bool calcPosition(int64_t placeNo, const EngineOptions &options, char *hexOutput, std::string &engine, char *verifyOutput = nullptr)
+{
+  char *verify = options.verify ? verifyOutput : nullptr;
+  if (options.accumulator == "fixed64") {return calcPositionAs<Fixed64>(placeNo, options.backend, hexOutput, engine, verify);}
+  if (options.accumulator == "fixed128") {return calcPositionAs<Fixed128>(placeNo, options.backend, hexOutput, engine, verify);}
+  std::string precision = options.precision == "auto" ? autoPrecision(options.backend, placeNo) : options.precision;
+  if (precision == "long-double") {return calcPositionAs<long double>(placeNo, options.backend, hexOutput, engine, verify);}
+  if (precision == "double-double") {return calcPositionAs<DoubleDouble>(placeNo, options.backend, hexOutput, engine, verify);}
+  if (precision == "float128") {return calcPositionAs<__float128>(placeNo, options.backend, hexOutput, engine, verify);}
+  return calcPositionAs<double>(placeNo, options.backend, hexOutput, engine, verify);
+}
+
+// Worker side of the distributed mode, answers a job line from a coordinator with this node's share of the Left Portion
+template <typename Real> std::string serveJobAs(const std::string &backend, int64_t d, int64_t kstart, int64_t kend)
+{
+  const char *kernelName;
+  LeftPortionKernel<Real> leftPortionTerms = selectKernel<Real>(backend, d, &kernelName);
+  if (!leftPortionTerms) {return "error The fixed point accumulators need the integer backend";}
+  Real s[4] = {};
+  leftPortion(s, kstart, kend, d, leftPortionTerms);
+  return "result " + toBytes(s) + " " + kernelName;
+}
+
+std::string serveJob(const std::string &job)
+{
+  std::istringstream in(job);
+  std::string word, precision, backend;
+  int64_t d, kstart, kend;
+  if (!(in >> word >> precision >> backend >> d >> kstart >> kend) || word != "job" || kstart < 0 || kend < kstart || kend > d) {return "error Bad job";}
+  if (precision == "double") {return serveJobAs<double>(backend, d, kstart, kend);}
+  if (precision == "long-double") {return serveJobAs<long double>(backend, d, kstart, kend);}
+  if (precision == "double-double") {return serveJobAs<DoubleDouble>(backend, d, kstart, kend);}
+  if (precision == "float128") {return serveJobAs<__float128>(backend, d, kstart, kend);}
+  if (precision == "fixed64") {return serveJobAs<Fixed64>(backend, d, kstart, kend);}
+  if (precision == "fixed128") {return serveJobAs<Fixed128>(backend, d, kstart, kend);}
+  return "error Unknown precision " + precision;
+}
+
+// Serve coordinators until killed, each call from a coordinator has its own connection and thread, they share the pool
+int runWorker(int port)
+{
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int reuse = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listener, 16) != 0)
+  {
+    std::cerr << "Can't listen on port " << port << std::endl;
+    return 1;
+  }
+  std::cout << "Worker Listening on Port: " << port << ", Using " << noOfThreads << " CPU Threads" << std::endl;
+  while (true)
+  {
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd < 0) {continue;}
+    std::thread([fd]()
+    {
+      std::string job;
+      if (sendLine(fd, "bbp-pi-parallel 1 " + std::to_string(noOfThreads)) && readLine(fd, job)) {sendLine(fd, serveJob(job));}
+      close(fd);
+    }).detach();
+  }
+}
+
+// Range mode - streams (digits) hex digits starting after position placeNo. Positions (stride) apart are calculated
+// together in blocks of rangeBlock, each giving its first (stride) digits, so the O(d) left portion is walked once per block
+const int64_t rangeBlock = 256;
+
+template <typename Real> int maxStride() { return sumBits<Real>()/4; } // Hex digits the sum type holds
+
+// The largest stride whose digits the error bound covers up to the last position, with two digits to spare so that few
+// positions fall close enough to a digit boundary to need recalculating
+template <typename Real> int safeStride(int64_t dlast)
+{
+  double bound = errorBound<Real>(dlast, true);
+  int stride = 1;
+  while (stride < maxStride<Real>() && 2*bound*std::pow(16., stride + 3) <= 1) {stride++;}
+  return stride;
+}
+
+template <typename Real> bool calcRangeAs(int64_t placeNo, int64_t digits, int stride, const std::string &backend)
+{
+  if (backend == "fp" || stride < 1 || stride > maxStride<Real>())
+  {
+    std::cerr << "Range mode needs the integer backend and a stride from 1 to " << maxStride<Real>() << " with " << precisionName<Real>() << std::endl;
+    return false;
+  }
+  std::cout << "Range Kernel: Integer Montgomery, Precision: " << precisionName<Real>() << ", Stride: " << stride << std::endl;
+  std::cout << "Pi Hex: " << std::flush;
+  std::vector<char> hexOutput(std::max(stride, 9) + 1); // calcPositionAs terminates its nine digits
+  int64_t recalculated = 0;
+  for (int64_t done = 0; done < digits; done = done + rangeBlock*stride)
+  {
+    int64_t count = std::min(rangeBlock, (digits - done + stride - 1)/stride);
+    std::vector<Real> sj(count*4);
+    bbpf16jsdRangeCached(&sj[0], placeNo + done, stride, count);
+    for (int64_t p = 0; p < count; p++)
+    {
+      int64_t d = placeNo + done + p*stride, wanted = std::min<int64_t>(stride, digits - done - p*stride);
+      Real piArr;
+      combineSeries(piArr, &sj[p*4]);
+      int have = guaranteedDigits(toFixed128(piArr), errorBound<Real>(d, true), wanted);
+      toHex(&hexOutput[0], &piArr, stride);
+      std::cout.write(&hexOutput[0], have);
+      while (have < wanted) // Too close to a digit boundary for the bound, the rest of the position's digits come from fixed128
+      {
+        std::string engine;
+        calcPositionAs<Fixed128>(d + have, "int", &hexOutput[0], engine, nullptr);
+        int more = std::min<int>(std::strlen(&hexOutput[0]), wanted - have);
+        if (more == 0) {std::cout << std::endl; std::cerr << "No digit can be guaranteed at position " << (d + have + 1) << std::endl; return false;}
+        std::cout.write(&hexOutput[0], more);
+        have = have + more;
+        recalculated++;
+      }
+    }
+    std::cout << std::flush;
+  }
+  std::cout << std::endl;
+  if (recalculated > 0) {std::cout << "Positions Recalculated in fixed128: " << recalculated << std::endl;}
+  return true;
+}
+
+// Time for one term of one position in the range kernel, relative to double, measured at stride 1 around 10^5 on x86-64.
+// __float128 is left out of the auto choice, at 26 it never pays for its few more digits
+template <typename Real> double rangeTermCost();
+template <> double rangeTermCost<double>() { return 1.; }
+template <> double rangeTermCost<long double>() { return 2.4; }
+template <> double rangeTermCost<DoubleDouble>() { return 3.7; }
+template <> double rangeTermCost<Fixed64>() { return 1.6; }
+template <> double rangeTermCost<Fixed128>() { return 2.6; }
+
+// Cost of (digits) from placeNo at the type's default stride, in units of a double term
+template <typename Real> double rangeCost(int64_t placeNo, int64_t digits)
+{
+  int stride = safeStride<Real>(placeNo + digits);
+  return rangeTermCost<Real>() * ((digits + stride - 1)/stride);
+}
+
+// The precision range mode will use for (digits) from placeNo. A wider type costs more per term but its error bound allows
+// a longer stride, so auto takes the one with the lowest cost for the whole range
+std::string rangePrecision(const EngineOptions &options, int64_t placeNo, int64_t digits)
+{
+  if (options.accumulator != "float") {return options.accumulator;}
+  if (options.precision != "auto") {return options.precision;}
+  std::string best = "double";
+  double bestCost = rangeCost<double>(placeNo, digits);
+  const char *names[] = {"long-double", "double-double", "fixed64", "fixed128"};
+  double costs[] = {rangeCost<long double>(placeNo, digits), rangeCost<DoubleDouble>(placeNo, digits), rangeCost<Fixed64>(placeNo, digits), rangeCost<Fixed128>(placeNo, digits)};
+  bool longDouble64 = std::numeric_limits<long double>::digits >= 64; // Otherwise long double is just double
+  for (int i = 0; i < 4; i++)
+  {
+    if (i == 0 && !longDouble64) {continue;}
+    if (costs[i] < bestCost) {best = names[i]; bestCost = costs[i];}
+  }
+  return best;
+}
+
+// Stride for --stride=0, the default, chosen by the error bound of the range's precision
+int rangeStride(const EngineOptions &options, int64_t placeNo, int64_t digits)
+{
+  std::string precision = rangePrecision(options, placeNo, digits);
+  if (precision == "fixed64") {return safeStride<Fixed64>(placeNo + digits);}
+  if (precision == "fixed128") {return safeStride<Fixed128>(placeNo + digits);}
+  if (precision == "long-double") {return safeStride<long double>(placeNo + digits);}
+  if (precision == "double-double") {return safeStride<DoubleDouble>(placeNo + digits);}
+  if (precision == "float128") {return safeStride<__float128>(placeNo + digits);}
+  return safeStride<double>(placeNo + digits);
+}
+
+bool calcRange(int64_t placeNo, const EngineOptions &options, int64_t digits, int stride)
+{
+  std::string precision = rangePrecision(options, placeNo, digits);
+  if (precision == "fixed64") {return calcRangeAs<Fixed64>(placeNo, digits, stride, options.backend);}
+  if (precision == "fixed128") {return calcRangeAs<Fixed128>(placeNo, digits, stride, options.backend);}
+  if (precision == "long-double") {return calcRangeAs<long double>(placeNo, digits, stride, options.backend);}
+  if (precision == "double-double") {return calcRangeAs<DoubleDouble>(placeNo, digits, stride, options.backend);}
+  if (precision == "float128") {return calcRangeAs<__float128>(placeNo, digits, stride, options.backend);}
+  return calcRangeAs<double>(placeNo, digits, stride, options.backend);
+}
+
+// Batch mode - every position shares the one worker pool. Up to (overlap) positions are in flight at once, so while one
+// is finishing its reductions the workers are already busy with the blocks of the next.
+// Results are printed as each position finishes, which may not be the order given
+int runBatch(const std::vector<int64_t> &positions, const EngineOptions &options, uint overlap)
+{
+  std::mutex outputMutex;
+  size_t next = 0; // Next position to start, guarded by outputMutex
+  int status = 0;
+  std::vector<std::thread> drivers;
+  for (uint i = 0; i < overlap; i++)
+  {
+    drivers.push_back(std::thread([&]()
+    {
+      while (true)
+      {
+        int64_t position;
+        {
+          std::lock_guard<std::mutex> lock(outputMutex);
+          if (next == positions.size()) {return;}
+          position = positions[next++];
+        }
+        char hexOutput[] = "000000000", verifyOutput[] = "000000000";
+        std::string engine;
+        bool ok = calcPosition(position - 1, options, hexOutput, engine, verifyOutput);
+        std::lock_guard<std::mutex> lock(outputMutex);
+        if (ok)
+        {
+          std::cout << "Position: " << position << " Hex: " << (hexOutput[0] ? hexOutput : "(none guaranteed)") << " (" << engine << ")";
+          if (options.verify)
+          {
+            int compared, agree = agreeingDigits(hexOutput, verifyOutput, compared);
+            std::cout << " Bellard: " << verifyOutput << " (" << agree << " of " << compared << " agree)";
+            if (agree < compared) {status = 1;}
+          }
+          std::cout << std::endl;
+        }
+        else {std::cerr << "Position: " << position << " The fixed point accumulators need the integer backend" << std::endl; status = 1;}
+      }
+    }));
+  }
+  for (uint i = 0; i < drivers.size(); i++) {drivers[i].join();}
+  return status;
+}
+
+// Benchmark mode - every position with every thread count, (trials) times each, as CSV of the median and standard deviation
+// of each phase. Each thread count gets its own pool
+int runBenchmark(const std::vector<int64_t> &positions, const std::vector<uint> &threadCounts, int trials, const EngineOptions &options, const std::string &csvPath)
+{
+  std::ofstream file;
+  if (!csvPath.empty())
+  {
+    file.open(csvPath);
+    if (!file) {std::cerr << "Can't write " << csvPath << std::endl; return 1;}
+  }
+  std::ostream &csv = csvPath.empty() ? std::cout : file;
+  csv << "position,threads,engine,hex,phase,trials,median_s,stddev_s" << std::endl;
+  ThreadPool *mainPool = workerPool;
+  uint mainThreads = noOfThreads;
+  for (size_t t = 0; t < threadCounts.size(); t++)
+  {
+    noOfThreads = threadCounts[t];
+    ThreadPool pool(noOfThreads, workerCpus);
+    workerPool = &pool;
+    for (size_t p = 0; p < positions.size(); p++)
+    {
+      std::vector<double> left, right, total;
+      char hexOutput[] = "000000000";
+      std::string engine;
+      for (int trial = 0; trial < trials; trial++)
+      {
+        PhaseTimes times;
+        phaseTimes = &times;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool ok = calcPosition(positions[p] - 1, options, hexOutput, engine);
+        total.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        phaseTimes = nullptr;
+        if (!ok) {std::cerr << "The fixed point accumulators need the integer backend" << std::endl; return 1;}
+        left.push_back(times.left);
+        right.push_back(times.right);
+      }
+      const char *phases[] = {"left", "right", "total"};
+      std::vector<double> *phaseTimings[] = {&left, &right, &total};
+      for (int ph = 0; ph < 3; ph++)
+      {
+        double median, stddev;
+        summarise(*phaseTimings[ph], median, stddev);
+        csv << positions[p] << "," << noOfThreads << ",\"" << engine << "\"," << hexOutput << "," << phases[ph] << "," << trials << "," << median << "," << stddev << std::endl;
+        if (!csvPath.empty() && ph == 2) {std::cout << "Position: " << positions[p] << " Threads: " << noOfThreads << " Median: " << median << " s" << std::endl;}
+      }
+    }
+  }
+  workerPool = mainPool;
+  noOfThreads = mainThreads;
+  return 0;
+}
+
+// Service mode - answers queries of one JSON object per line, such as {"id": 7, "position": 1000000, "precision": "double"},
+// with {"id": 7, "position": 1000000, "hex": "26C65E", "engine": "...", "seconds": 0.05} or an "error". backend,
+// accumulator and precision are optional and default to the command line's, the id is sent back as it came.
+// The queries share the warm pool and the result cache
+std::string serveQuery(const std::string &line, const EngineOptions &defaults)
+{
+  std::map<std::string, std::string> fields;
+  if (!parseJsonObject(line, fields)) {return "{\"id\": null, \"error\": \"Bad request\"}";}
+  std::string id = fields.count("id") ? fields["id"] : "null";
+  EngineOptions options = defaults;
+  if (fields.count("backend")) {options.backend = jsonUnquote(fields["backend"]);}
+  if (fields.count("accumulator")) {options.accumulator = jsonUnquote(fields["accumulator"]);}
+  if (fields.count("precision")) {options.precision = jsonUnquote(fields["precision"]);}
+  if (fields.count("verify")) {options.verify = fields["verify"] == "true";}
+  int64_t position = fields.count("position") ? std::atoll(jsonUnquote(fields["position"]).c_str()) : 0;
+  std::ostringstream out;
+  out << "{\"id\": " << id << ", \"position\": " << position;
+  char hexOutput[] = "000000000", verifyOutput[] = "000000000";
+  std::string engine, error = optionsError(options);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  if (!error.empty()) {out << ", \"error\": " << jsonQuote(error);}
+  else if (position < 1) {out << ", \"error\": \"Positions start from 1\"";}
+  else if (!calcPosition(position - 1, options, hexOutput, engine, verifyOutput)) {out << ", \"error\": \"The fixed point accumulators need the integer backend\"";}
+  else
+  {
+    out << ", \"hex\": \"" << hexOutput << "\", \"engine\": " << jsonQuote(engine);
+    int compared;
+    if (options.verify) {out << ", \"bellard\": \"" << verifyOutput << "\", \"agree\": " << agreeingDigits(hexOutput, verifyOutput, compared) << ", \"compared\": " << compared;}
+    out << ", \"seconds\": " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+  out << "}";
+  return out.str();
+}
+
+// Serve queries until the input ends, from stdin to stdout when socketPath is empty and otherwise on a Unix socket, where
+// each connection has its own thread. On stdin up to (overlap) queries run at once and answers may come out of order
+int runServe(const std::string &socketPath, const EngineOptions &defaults, uint overlap)
+{
+  if (socketPath.empty())
+  {
+    std::mutex ioMutex;
+    std::vector<std::thread> drivers;
+    for (uint i = 0; i < overlap; i++)
+    {
+      drivers.push_back(std::thread([&]()
+      {
+        std::string line;
+        while (true)
+        {
+          {
+            std::lock_guard<std::mutex> lock(ioMutex);
+            do {if (!std::getline(std::cin, line)) {return;}} while (line.find_first_not_of(" \t\r") == std::string::npos);
+          }
+          std::string answer = serveQuery(line, defaults);
+          std::lock_guard<std::mutex> lock(ioMutex);
+          std::cout << answer << std::endl;
+        }
+      }));
+    }
+    for (uint i = 0; i < drivers.size(); i++) {drivers[i].join();}
+    return 0;
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path)) {std::cerr << "Socket path too long: " << socketPath << std::endl; return 1;}
+  std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+  unlink(socketPath.c_str()); // Left by an earlier run
+  if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listener, 64) != 0)
+  {
+    std::cerr << "Can't listen on " << socketPath << std::endl;
+    return 1;
+  }
+  std::cerr << "Serving on " << socketPath << ", Using " << noOfThreads << " CPU Threads" << std::endl;
+  while (true)
+  {
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd < 0) {continue;}
+    std::thread([fd, &defaults]()
+    {
+      std::string line;
+      while (readLine(fd, line))
+      {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {continue;}
+        if (!sendLine(fd, serveQuery(line, defaults))) {break;}
+      }
+      close(fd);
+    }).detach();
+  }
+}
+
+}
+
+// Library interface, see bbp-pi-parallel.h. The engine's pool is the one workerPool points to, as main's is
+struct BbpEngine::State
+{
+  ThreadPool pool;
+  explicit State(uint threads) : pool(threads) {}
+};
+
+BbpEngine::BbpEngine(unsigned threads, const std::string &cachePath)
+{
+  noOfThreads = threads > 0 ? threads : std::max(std::thread::hardware_concurrency(), 1u);
+  progress.counters = std::vector<TermCounter>(noOfThreads + 1);
+  state = new State(noOfThreads);
+  workerPool = &state->pool;
+  if (!cachePath.empty()) {resultCache.open(cachePath);} // Without a cache if it can't be opened, open says why
+}
+
+BbpEngine::~BbpEngine()
+{
+  workerPool = nullptr;
+  delete state;
+}
+
+DigitResult BbpEngine::hexDigits(int64_t position, const EngineOptions &options)
+{
+  DigitResult result;
+  char hexOutput[] = "000000000", verifyOutput[] = "000000000";
+  std::string error = optionsError(options);
+  if (!error.empty()) {result.engine = error;}
+  else if (position < 1) {result.engine = "Positions start from 1";}
+  else if (!calcPosition(position - 1, options, hexOutput, result.engine, verifyOutput)) {result.engine = "The fixed point accumulators need the integer backend";}
+  else
+  {
+    result.ok = true;
+    result.hex = hexOutput;
+    if (options.verify) {result.verifyHex = verifyOutput;}
+  }
+  return result;
+}
+
+#ifndef BBP_PI_PARALLEL_LIBRARY
+int main(int argc, char *argv[]) {
+  EngineOptions options;
+  std::vector<int64_t> batchPositions;
+  uint overlap = 2;
+  int64_t rangeDigits = 0;
+  int stride = 0; // Chosen from the error bound
+  uint threads = 0; // 0 is all available
+  int workerPort = 0;
+  std::string checkpointPath;
+  std::string cachePath;
+  bool serve = false;
+  std::string serveSocket; // Empty for stdin
+  std::string affinity = "none";
+  bool benchmark = false;
+  std::vector<int64_t> benchmarkPositions;
+  std::vector<uint> benchmarkThreads;
+  int benchmarkTrials = 3;
+  std::string benchmarkCsv;
+  bool profile = false;
+  uint64_t profileFpEvent = 0; // 0 for the vendor's default
+  std::vector<char *> positional; // Digit and number of threads, options can go anywhere
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg.compare(0, 10, "--backend=") == 0) {options.backend = arg.substr(10);}
+    else if (arg.compare(0, 14, "--accumulator=") == 0) {options.accumulator = arg.substr(14);}
+    else if (arg.compare(0, 12, "--precision=") == 0) {options.precision = arg.substr(12);}
+    else if (arg.compare(0, 8, "--range=") == 0) {rangeDigits = std::atoll(arg.c_str() + 8);}
+    else if (arg.compare(0, 9, "--stride=") == 0) {stride = std::atoi(arg.c_str() + 9);}
+    else if (arg.compare(0, 10, "--threads=") == 0) {threads = std::atoi(arg.c_str() + 10) > 0 ? static_cast<uint>(std::atoi(arg.c_str() + 10)) : 0;}
+    else if (arg.compare(0, 13, "--checkpoint=") == 0) {checkpointPath = arg.substr(13);}
+    else if (arg.compare(0, 22, "--checkpoint-interval=") == 0) {checkpoint.interval = std::atof(arg.c_str() + 22) > 0 ? std::atof(arg.c_str() + 22) : 60;}
+    else if (arg == "--resume") {checkpoint.resume = true;}
+    else if (arg == "--verify") {options.verify = true;}
+    else if (arg == "--profile") {profile = true;}
+    else if (arg.compare(0, 19, "--profile-fp-event=") == 0) {profile = true; profileFpEvent = std::strtoull(arg.c_str() + 19, nullptr, 0);}
+    else if (arg.compare(0, 8, "--cache=") == 0) {cachePath = arg.substr(8);}
+    else if (arg == "--serve" || arg.compare(0, 8, "--serve=") == 0) {serve = true; serveSocket = arg.size() > 8 ? arg.substr(8) : "";}
+    else if (arg.compare(0, 11, "--progress=") == 0) {progress.interval = std::atof(arg.c_str() + 11);}
+    else if (arg.compare(0, 16, "--progress-json=") == 0) {progress.jsonPath = arg.substr(16);}
+    else if (arg.compare(0, 11, "--affinity=") == 0) {affinity = arg.substr(11);}
+    else if (arg == "--benchmark") {benchmark = true;}
+    else if (arg.compare(0, 22, "--benchmark-positions=") == 0)
+    {
+      std::stringstream list(arg.substr(22));
+      for (std::string item; std::getline(list, item, ',');)
+      {
+        if (!parsePositions(item, benchmarkPositions)) {std::cerr << "Bad position: " << item << std::endl; return 1;}
+      }
+    }
+    else if (arg.compare(0, 20, "--benchmark-threads=") == 0)
+    {
+      std::stringstream list(arg.substr(20));
+      for (std::string item; std::getline(list, item, ',');)
+      {
+        if (std::atoi(item.c_str()) < 1) {std::cerr << "Bad thread count: " << item << std::endl; return 1;}
+        benchmarkThreads.push_back(std::atoi(item.c_str()));
+      }
+    }
+    else if (arg.compare(0, 19, "--benchmark-trials=") == 0) {benchmarkTrials = std::atoi(arg.c_str() + 19) > 0 ? std::atoi(arg.c_str() + 19) : 1;}
+    else if (arg.compare(0, 16, "--benchmark-csv=") == 0) {benchmarkCsv = arg.substr(16);}
+    else if (arg.compare(0, 9, "--worker=") == 0) {workerPort = std::atoi(arg.c_str() + 9);}
+    else if (arg.compare(0, 8, "--nodes=") == 0)
+    {
+      std::stringstream list(arg.substr(8));
+      for (std::string node; std::getline(list, node, ',');) {cluster.nodes.push_back(node);}
+    }
+    else if (arg.compare(0, 10, "--overlap=") == 0) {overlap = std::atoi(arg.c_str() + 10) > 0 ? static_cast<uint>(std::atoi(arg.c_str() + 10)) : 1;}
+    else if (arg.compare(0, 12, "--positions=") == 0 || arg.compare(0, 17, "--positions-file=") == 0)
+    {
+      std::vector<std::string> items;
+      if (arg[11] == '=') // A comma separated list
+      {
+        std::stringstream list(arg.substr(12));
+        for (std::string item; std::getline(list, item, ',');) {items.push_back(item);}
+      } else // A file of whitespace separated items
+      {
+        std::ifstream file(arg.substr(17));
+        if (!file) {std::cerr << "Can't open " << arg.substr(17) << std::endl; return 1;}
+        for (std::string item; file >> item;) {items.push_back(item);}
+      }
+      for (size_t l = 0; l < items.size(); l++)
+      {
+        if (!parsePositions(items[l], batchPositions)) {std::cerr << "Bad position: " << items[l] << std::endl; return 1;}
+      }
+    }
+    else {positional.push_back(argv[i]);}
+  }
+  std::string optionError = optionsError(options);
+  if (!optionError.empty()) {std::cerr << optionError << std::endl; return 1;}
+  std::ostream &info = (serve && serveSocket.empty()) || (benchmark && benchmarkCsv.empty()) ? std::cerr : std::cout; // Serving or a CSV on stdout leaves it for those
+  info << "Bailey–Borwein–Plouffe Formula for Pi" << std::endl;
+  info << "Built: " << __DATE__ << " " << __TIME__ << std::endl << std::endl;
+  int64_t placeNo = (positional.size() >= 1) && (std::atoll(positional[0]) > 0) ? std::atoll(positional[0]) - 1 : 10000000 - 1; // Accurate to 10000000
+  if (positional.size() >= 2 && std::atoi(positional[1]) > 0) {threads = static_cast<uint>(std::atoi(positional[1]));}
+  if (affinity == "cores" || affinity == "all")
+  {
+    int nodes;
+    workerCpus = affinityCpus(affinity == "cores", nodes);
+    if (workerCpus.empty()) {std::cerr << "Can't read the CPU topology, workers won't be pinned" << std::endl;}
+    else {info << "Affinity: " << affinity << ", " << workerCpus.size() << " CPUs on " << nodes << " NUMA Nodes" << std::endl;}
+  }
+  else if (affinity != "none") {std::cerr << "Unknown affinity: " << affinity << std::endl; return 1;}
+  noOfThreads = threads > 0 ? threads : (!workerCpus.empty() ? workerCpus.size() : std::thread::hardware_concurrency()); // Pinned, one worker per CPU used
+  if (!progress.jsonPath.empty() && progress.interval <= 0) {progress.interval = 10;}
+  if (benchmark) {progress.interval = 0;} // Each thread count has its own pool, the timings are the report
+  progress.counters = std::vector<TermCounter>(noOfThreads + 1);
+  if (rangeDigits > 0 && stride == 0) {stride = rangeStride(options, placeNo, rangeDigits);}
+  if (!batchPositions.empty()) {for (size_t i = 0; i < batchPositions.size(); i++) {progress.planned = progress.planned + batchPositions[i] - 1;}}
+  else if (rangeDigits > 0 && stride > 0) {for (int64_t done = 0; done < rangeDigits; done = done + rangeBlock*stride) {progress.planned = progress.planned + placeNo + std::min(rangeDigits - 1, done + (rangeBlock - 1)*stride);}}
+  else {progress.planned = placeNo;}
+  if (profile && workerPort > 0) {std::cerr << "Profiling is for the coordinator, not workers" << std::endl; return 1;}
+  if (profile) {profiler.open(profileFpEvent, std::vector<std::string>(phaseNames, phaseNames + phaseCount)); overlap = 1;} // Before the pool so its threads are counted, one position at a time so the phases don't overlap
+  ThreadPool pool(noOfThreads, workerCpus);
+  workerPool = &pool;
+  ProgressReporter reporter; // Stopped before the pool when main returns
+  struct ProfileReport { ~ProfileReport() { profiler.report(std::cerr, "Profile (user space, all threads):"); } } profileReport; // However main returns
+  cluster.backend = options.backend;
+  if (!checkpointPath.empty() && (workerPort > 0 || !batchPositions.empty() || rangeDigits > 0 || serve)) {std::cerr << "Checkpoints are only for single positions" << std::endl; return 1;}
+  if (checkpoint.resume && checkpointPath.empty()) {std::cerr << "--resume needs --checkpoint=FILE" << std::endl; return 1;}
+  checkpoint.path = checkpointPath;
+  checkpoint.accumulator = options.accumulator;
+  if (!cachePath.empty() && (benchmark || workerPort > 0)) {std::cerr << "The result cache isn't used by benchmarks or workers" << std::endl; return 1;}
+  if (!cachePath.empty() && !resultCache.open(cachePath)) {return 1;}
+  if (options.verify && (benchmark || workerPort > 0 || rangeDigits > 0)) {std::cerr << "--verify is for single positions, batches and --serve" << std::endl; return 1;}
+  if (workerPort > 0) {return runWorker(workerPort);}
+  if (benchmark)
+  {
+    if (benchmarkPositions.empty()) {for (int64_t p = 100000; p <= 100000000; p = p * 10) {benchmarkPositions.push_back(p);}}
+    if (benchmarkThreads.empty()) // Powers of two up to all the available threads
+    {
+      uint hardware = std::thread::hardware_concurrency() > 0 ? std::thread::hardware_concurrency() : 1;
+      for (uint t = 1; t < hardware; t = t * 2) {benchmarkThreads.push_back(t);}
+      benchmarkThreads.push_back(hardware);
+    }
+    return runBenchmark(benchmarkPositions, benchmarkThreads, benchmarkTrials, options, benchmarkCsv);
+  }
+  if (!cluster.nodes.empty()) {info << "Distributing Over " << cluster.nodes.size() << " Nodes" << std::endl;}
+  if (serve) {return runServe(serveSocket, options, overlap);}
+  if (!batchPositions.empty())
+  {
+    std::cout << "Calculating " << batchPositions.size() << " Positions, Using " << noOfThreads << " CPU Threads" << std::endl;
+    return runBatch(batchPositions, options, overlap);
+  }
+  std::cout << "Calculating Position: " << (placeNo + 1) << ", Using " << noOfThreads << " CPU Threads" << std::endl;
+  if (rangeDigits > 0) {return calcRange(placeNo, options, rangeDigits, stride) ? 0 : 1;}
+  char hexOutput[] = "000000000", verifyOutput[] = "000000000";
+  std::string engine;
+  if (!calcPosition(placeNo, options, hexOutput, engine, verifyOutput))
+  {
+    std::cerr << "The fixed point accumulators need the integer backend" << std::endl;
+    return 1;
+  }
+  std::cout << "Left Portion Kernel: " << engine << std::endl;
+  std::cout << "Pi Estimation Hex: " << (hexOutput[0] ? hexOutput : "(none guaranteed)") << std::endl;
+  if (!checkpoint.path.empty()) {std::remove(checkpoint.path.c_str());} // Finished, nothing left to resume
+  if (options.verify)
+  {
+    int compared, agree = agreeingDigits(hexOutput, verifyOutput, compared);
+    std::cout << "Bellard's Formula Hex: " << verifyOutput << " (" << agree << " of " << compared << " digits agree)" << std::endl;
+    if (agree < compared) {return 1;}
+  }
 }
+#endif
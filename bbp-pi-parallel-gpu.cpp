@@ -15,34 +15,50 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cctype>
+#include <chrono>
 #include <cmath>
+#include <limits>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
 // Header files for the HIP API
 #include <hip/hip_runtime.h>
 #include <hip/hip_runtime_api.h>
+#include <map>
+// Library interface
+#include "bbp-pi-parallel.h"
+// Progress, profiling, JSON and position list helpers shared with the CPU program
+#include "bbp-pi-parallel-internal.h"
+
+namespace {
+
+// Position of the highest set bit of n, n must be > 0
+__host__ __device__ inline int topBit(long long n)
+  {
+#if defined(__HIP_DEVICE_COMPILE__)
+    return 63 - __clzll(n);
+#else
+    return 63 - __builtin_clzll(n);
+#endif
+  }
 
 // Left-Right Binary algorithm for exponentiation with Modulo 16^n mod k
+// Stateless so it is safe to call from any host or device thread
 __host__ __device__ double expoMod(double n, double k)
   {
-    static int init = 0; // Store whether table initialised
-    static int pwrtbl[32]; // Table to store powers of 2
-    static int highestpwrtblpwr = 0; // After init, points to largest value in the table, which is <= n
-    while (!init) // Find largest power needed, as n counts down, do this only once
-    {
-      pwrtbl[0] = 1; // In theory first can be 0 but in practice this function is only called if n > 0, in which case greatest power is 1 or more
-      while (pwrtbl[highestpwrtblpwr] < n) // Used instead of for loop in order to check before iterating
-      {
-        pwrtbl[highestpwrtblpwr+1] = pwrtbl[highestpwrtblpwr] * 2; // Only generates up to and including n, nothing larger
-        highestpwrtblpwr++;
-      }
-      init = 1; // Set table as initialised
-    }
-
-    int bitsneeded = 0; // The number of binary positions and the location in the table of the highest needed power
-    for (; pwrtbl[bitsneeded]<n;bitsneeded++); // Move through table to find position of the largest power of two < n
-    if (pwrtbl[bitsneeded]!=n){bitsneeded--;} // Because the increment is applied before the condition check, we need to decrement by one, unless the item was equal to n
+    int bitsneeded = topBit(static_cast<long long>(n)); // The number of binary positions, in practice this function is only called if n > 0
 
     // First set t to be the largest power of two such that t ≤ n, and set r = 1.
-    int t = pwrtbl[bitsneeded];
+    long long t = 1LL << bitsneeded;
     double r = 1;
 
     // Loop by the number of Binary positions
@@ -64,8 +80,8 @@ __host__ __device__ double expoMod(double n, double k)
     return r;
   }
 
-// Left Portion for one thread - just does one term
-__device__ double leftPortionThreaded(int terms, int k, int j, int d)
+// Left Portion for one GPU thread or one CPU chunk
+__host__ __device__ double leftPortionThreaded(int terms, int k, int j, int d)
 {
   int kinit = k;
   double s = 0;
@@ -80,61 +96,530 @@ __device__ double leftPortionThreaded(int terms, int k, int j, int d)
   return s;
 }
 
-__global__ void kern(double *gpu_threadResults, int perThreadRuns, int j, int d, int k){
+const int maxThreadsPerBlock = 1024; // Size of the shared memory used by the block reductions
+
+// Tree reduction mod 1 of the partial sums held in shared memory by each thread of the block, the result ends up in partial[0]
+__device__ void blockReduce(double *partial)
+{
+  for (unsigned int stride = 1; stride < blockDim.x; stride = stride * 2)
+  {
+    if (threadIdx.x % (2*stride) == 0 && threadIdx.x + stride < blockDim.x)
+    {
+      partial[threadIdx.x] = partial[threadIdx.x] + partial[threadIdx.x + stride];
+      partial[threadIdx.x] = partial[threadIdx.x] - floor(partial[threadIdx.x]);
+    }
+    __syncthreads();
+  }
+}
+
+// A single launch covers a device's whole shard [kstart, kend) of the Left Portion with a grid-stride loop, each thread takes
+// perThreadRuns terms at a time and then moves on by the size of the whole grid, so the last partial chunk is done on the device too.
+// Each block reduces its threads' partial sums, so only one value per block is written out
+__global__ void kern(double *gpu_blockResults, int perThreadRuns, int j, int d, long long kstart, long long kend){
+  __shared__ double partial[maxThreadsPerBlock];
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  long long gridTerms = static_cast<long long>(gridDim.x) * blockDim.x * perThreadRuns;
+  double s = 0;
+  for (long long k = kstart + static_cast<long long>(idx) * perThreadRuns; k < kend; k = k + gridTerms) // Thread 0 starts at kstart, thread 1 at kstart + perThreadRuns &c.
+  {
+    int terms = kend - k < perThreadRuns ? static_cast<int>(kend - k) : perThreadRuns;
+    s = s + leftPortionThreaded(terms,static_cast<int>(k),j,d);
+    s = s - floor(s);
+  }
+  partial[threadIdx.x] = s;
+  __syncthreads();
+  blockReduce(partial);
+  if (threadIdx.x == 0) {gpu_blockResults[blockIdx.x] = partial[0];}
+}
+
+// Reduce the per block results to a single value, run as one block
+__global__ void reduceKern(const double *gpu_blockResults, int blocks, double *gpu_result){
+  __shared__ double partial[maxThreadsPerBlock];
+  double s = 0;
+  for (int i = threadIdx.x; i < blocks; i = i + blockDim.x)
+  {
+    s = s + gpu_blockResults[i];
+    s = s - floor(s);
+  }
+  partial[threadIdx.x] = s;
+  __syncthreads();
+  blockReduce(partial);
+  if (threadIdx.x == 0) {*gpu_result = partial[0];}
+}
+
+// 32-bit integer kernel, for GPUs whose 64-bit floating point rate is a small fraction of their 32-bit rate. The modular
+// exponentiation is done in Montgomery form with 32-bit multiplies and __umulhi, and each term is accumulated as a 64-bit
+// fixed point fraction, where unsigned wraparound is the reduction mod 1. Denominators have to be below 2^31
+
+// Montgomery product a x b / 2^32 mod m, with a, b < m < 2^31 and minv = -m^-1 mod 2^32
+__device__ inline unsigned int montMul32(unsigned int a, unsigned int b, unsigned int m, unsigned int minv)
+{
+  unsigned int lo = a * b;
+  unsigned int hi = __umulhi(a, b);
+  unsigned int q = lo * minv; // So the low word of a x b + q x m is 0, it carries out unless a x b's low word was already 0
+  unsigned int r = hi + __umulhi(q, m) + (lo != 0);
+  return r >= m ? r - m : r;
+}
+
+// 2^64 x frac(16^n / m) for n > 0
+__device__ unsigned long long fractionInt32(int n, unsigned int m)
+{
+  // 16^n / (2^shift x o) is 2^(4n - shift) / o, so work mod the odd part o and halve the result shift times
+  int shift = 0;
+  while ((m & 1) == 0) {m = m >> 1; shift++;}
+  if (m == 1) {return 0;}
+  unsigned int inv = m; // Right to 3 bits as m x m = 1 mod 8, each Newton step doubles that
+  for (int i = 0; i < 4; i++) {inv = inv * (2 - m * inv);}
+  unsigned int minv = 0u - inv;
+  unsigned int sixteen = (0u - m) % m; // 2^32 mod m, 1 in Montgomery form
+  for (int i = 0; i < 4; i++) // 16 in Montgomery form
+  {
+    sixteen = sixteen << 1;
+    if (sixteen >= m) {sixteen = sixteen - m;}
+  }
+  // Left-Right Binary exponentiation, starting from the top bit which is always set
+  unsigned int r = sixteen;
+  for (int i = topBit(n) - 1; i >= 0; i--)
+  {
+    r = montMul32(r, r, m, minv);
+    if ((n >> i) & 1) {r = montMul32(r, sixteen, m, minv);}
+  }
+  r = montMul32(r, 1, m, minv); // Out of Montgomery form
+  for (; shift > 0; shift--) {r = (r & 1) ? (r >> 1) + (m >> 1) + 1 : r >> 1;} // (r + m) / 2 without overflowing when r is odd
+  // Two 32-bit digits of r / m by long division
+  unsigned long long x = static_cast<unsigned long long>(r) << 32;
+  unsigned long long high = x / m;
+  x = (x % m) << 32;
+  return (high << 32) | (x / m);
+}
+
+// Tree reduction of 64-bit fixed point partial sums, unsigned wraparound makes it mod 1 and exact in any order
+__device__ void blockReduceFixed(unsigned long long *partial)
+{
+  for (unsigned int stride = 1; stride < blockDim.x; stride = stride * 2)
+  {
+    if (threadIdx.x % (2*stride) == 0 && threadIdx.x + stride < blockDim.x)
+    {
+      partial[threadIdx.x] = partial[threadIdx.x] + partial[threadIdx.x + stride];
+    }
+    __syncthreads();
+  }
+}
+
+// As kern, for the 32-bit integer path
+__global__ void kernInt32(unsigned long long *gpu_blockResults, int perThreadRuns, int j, int d, long long kstart, long long kend){
+  __shared__ unsigned long long partial[maxThreadsPerBlock];
   int idx = blockIdx.x * blockDim.x + threadIdx.x;
-  int k2 = k+(idx*perThreadRuns); // Thread 0 starts at k+0, thread 1 at k+(1*perThreadRuns) &c.
-  gpu_threadResults[idx] = leftPortionThreaded(perThreadRuns,k2,j,d);
+  long long gridTerms = static_cast<long long>(gridDim.x) * blockDim.x * perThreadRuns;
+  unsigned long long s = 0;
+  for (long long k = kstart + static_cast<long long>(idx) * perThreadRuns; k < kend; k = k + gridTerms)
+  {
+    long long last = kend - k < perThreadRuns ? kend : k + perThreadRuns;
+    for (long long i = k; i < last; i++) {s = s + fractionInt32(static_cast<int>(d - i), static_cast<unsigned int>(8 * i + j));}
+  }
+  partial[threadIdx.x] = s;
+  __syncthreads();
+  blockReduceFixed(partial);
+  if (threadIdx.x == 0) {gpu_blockResults[blockIdx.x] = partial[0];}
+}
+
+// As reduceKern, the single result is converted back to a fraction in double
+__global__ void reduceKernInt32(const unsigned long long *gpu_blockResults, int blocks, double *gpu_result){
+  __shared__ unsigned long long partial[maxThreadsPerBlock];
+  unsigned long long s = 0;
+  for (int i = threadIdx.x; i < blocks; i = i + blockDim.x) {s = s + gpu_blockResults[i];}
+  partial[threadIdx.x] = s;
+  __syncthreads();
+  blockReduceFixed(partial);
+  if (threadIdx.x == 0) {*gpu_result = ldexp(static_cast<double>(partial[0]), -64);}
+}
+
+const long long int32Limit = (1LL << 31) - 8; // The int32 kernel needs 8k + j below 2^31
+
+// Kernel launch configuration, the defaults suit a Radeon VII. --autotune finds the best for a device and saves it as a profile
+struct LaunchConfig
+{
+  int blocks = 80;
+  int threadsPerBlock = 60;
+  int perThreadRuns = 2000;
+  std::string kernel = "fp64"; // fp64, or int32 for the 32-bit integer path
+};
+
+// Results and events of one shard in flight on a device. Each device has two, so the next shard is queued on the stream
+// before the last one is waited for and the copy back and the next launch overlap
+struct ShardBuffer
+{
+  hipEvent_t start, stop; // Around the shard's work on the stream, to time it
+  hipEvent_t kernelDone, reduceDone; // Between the kernel, the reduction and the copy, for --profile
+  double *gpu_blockResults, *gpu_result, *result;
+  unsigned long long *gpu_fixedBlockResults; // Per block results for the int32 kernel
+  int allocatedBlocks = 0; // Size of gpu_blockResults and gpu_fixedBlockResults
+  long long kstart, kend; // The shard's terms
+};
+
+// Everything one device needs for its shards of a series, set up once so that each series only launches and copies
+struct GpuDevice
+{
+  int id;
+  hipDeviceProp_t props;
+  LaunchConfig config;
+  hipStream_t stream;
+  ShardBuffer buffers[2];
+  double kernelMs = 0, reduceMs = 0, copyMs = 0; // Totals over every shard
+  long long shards = 0;
+  double throughput; // Terms per second, measured on each chunk and used to size the device's next one, 0 until then
+};
+std::vector<GpuDevice> devices;
+
+const long long minTimedTerms = 1000000; // Shorter shards are mostly launch overhead, so they don't update the throughput
+
+void setupDevice(GpuDevice &dev, int id)
+{
+  dev.id = id;
+  hipSetDevice(id);
+  hipGetDeviceProperties(&dev.props, id);
+  hipStreamCreate(&dev.stream);
+  for (int b = 0; b < 2; b++)
+  {
+    ShardBuffer &buf = dev.buffers[b];
+    hipEventCreate(&buf.start);
+    hipEventCreate(&buf.stop);
+    hipEventCreate(&buf.kernelDone);
+    hipEventCreate(&buf.reduceDone);
+    hipMalloc(&buf.gpu_result,sizeof(double));
+    hipHostMalloc(&buf.result,sizeof(double)); // Pinned, so the copy really is asynchronous
+    buf.gpu_blockResults = nullptr;
+    buf.gpu_fixedBlockResults = nullptr;
+  }
+  dev.throughput = 0;
+}
+
+void releaseDevice(GpuDevice &dev)
+{
+  hipSetDevice(dev.id);
+  for (int b = 0; b < 2; b++)
+  {
+    ShardBuffer &buf = dev.buffers[b];
+    hipHostFree(buf.result);
+    hipFree(buf.gpu_result);
+    hipFree(buf.gpu_blockResults);
+    hipFree(buf.gpu_fixedBlockResults);
+    hipEventDestroy(buf.reduceDone);
+    hipEventDestroy(buf.kernelDone);
+    hipEventDestroy(buf.stop);
+    hipEventDestroy(buf.start);
+  }
+  hipStreamDestroy(dev.stream);
+}
+
+// Queue the shard in dev.buffers[b] on the device's stream without waiting, so that all the devices work at once and the
+// device already has its next shard while the last one's result is copied back
+void launchShard(GpuDevice &dev, int b, int j, int d)
+{
+  hipSetDevice(dev.id);
+  ShardBuffer &buf = dev.buffers[b];
+  int blocks = dev.config.blocks;
+  int threadsPerBlock = dev.config.threadsPerBlock;
+  int perThreadRuns = dev.config.perThreadRuns;
+  int reduceThreads = blocks < maxThreadsPerBlock ? blocks : maxThreadsPerBlock;
+  long long gridThreads = static_cast<long long>(blocks) * threadsPerBlock;
+  long long terms = buf.kend - buf.kstart;
+  if (perThreadRuns * gridThreads > terms) {perThreadRuns = static_cast<int>((terms + gridThreads - 1) / gridThreads);} // Small shards, spread the terms over every thread
+  if (perThreadRuns < 1) {perThreadRuns = 1;}
+  if (blocks > buf.allocatedBlocks)
+  {
+    hipFree(buf.gpu_blockResults);
+    hipFree(buf.gpu_fixedBlockResults);
+    hipMalloc(&buf.gpu_blockResults,blocks*sizeof(double));
+    hipMalloc(&buf.gpu_fixedBlockResults,blocks*sizeof(unsigned long long));
+    buf.allocatedBlocks = blocks;
+  }
+  *buf.result = 0;
+  hipEventRecord(buf.start,dev.stream);
+  if (terms > 0)
+  {
+    // One launch for the whole shard, reduce on the device and copy back the single result
+    if (dev.config.kernel == "int32" && 8 * buf.kend + j < int32Limit)
+    {
+      hipLaunchKernelGGL(kernInt32,dim3(blocks),dim3(threadsPerBlock),0,dev.stream,buf.gpu_fixedBlockResults,perThreadRuns,j,d,buf.kstart,buf.kend);
+      hipEventRecord(buf.kernelDone,dev.stream);
+      hipLaunchKernelGGL(reduceKernInt32,dim3(1),dim3(reduceThreads),0,dev.stream,buf.gpu_fixedBlockResults,blocks,buf.gpu_result);
+    } else
+    {
+      hipLaunchKernelGGL(kern,dim3(blocks),dim3(threadsPerBlock),0,dev.stream,buf.gpu_blockResults,perThreadRuns,j,d,buf.kstart,buf.kend);
+      hipEventRecord(buf.kernelDone,dev.stream);
+      hipLaunchKernelGGL(reduceKern,dim3(1),dim3(reduceThreads),0,dev.stream,buf.gpu_blockResults,blocks,buf.gpu_result);
+    }
+    hipEventRecord(buf.reduceDone,dev.stream);
+    hipMemcpyAsync(buf.result,buf.gpu_result,sizeof(double),hipMemcpyDeviceToHost,dev.stream);
+  }
+  hipEventRecord(buf.stop,dev.stream);
+}
+
+// Wait for the shard in dev.buffers[b] alone, not any queued after it, update the device's measured throughput and return
+// its part of the sum. The stream runs in order, so the shard's events only time its own work
+double finishShard(GpuDevice &dev, int b)
+{
+  hipSetDevice(dev.id);
+  ShardBuffer &buf = dev.buffers[b];
+  hipEventSynchronize(buf.stop);
+  long long terms = buf.kend - buf.kstart;
+  float ms = 0;
+  if (terms >= minTimedTerms && hipEventElapsedTime(&ms,buf.start,buf.stop) == hipSuccess && ms > 0) {dev.throughput = terms / (ms / 1000.);}
+  if (terms > 0)
+  {
+    float kernelMs = 0, reduceMs = 0, copyMs = 0;
+    hipEventElapsedTime(&kernelMs,buf.start,buf.kernelDone);
+    hipEventElapsedTime(&reduceMs,buf.kernelDone,buf.reduceDone);
+    hipEventElapsedTime(&copyMs,buf.reduceDone,buf.stop);
+    dev.kernelMs = dev.kernelMs + kernelMs;
+    dev.reduceMs = dev.reduceMs + reduceMs;
+    dev.copyMs = dev.copyMs + copyMs;
+    dev.shards++;
+  }
+  return *buf.result;
+}
+
+// The Left Portion's k-range is shared out from both ends, the GPUs take large chunks from the front and the CPU threads small
+// ones from the back, so each side's share follows its speed and they run out of work together
+struct WorkQueue
+{
+  std::mutex lock;
+  long long front = 0, back = 0;
+
+  // Take up to terms from one end. Near the end no more than half of what's left is taken, so the other side can still steal a
+  // share instead of waiting for one large final chunk, but never less than minimum
+  bool take(long long terms, long long minimum, bool fromFront, long long &kstart, long long &kend)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    long long remaining = back - front;
+    if (remaining <= 0) {return false;}
+    if (terms > (remaining + 1) / 2) {terms = (remaining + 1) / 2;}
+    if (terms < minimum) {terms = minimum;}
+    if (terms > remaining) {terms = remaining;}
+    if (fromFront) {kstart = front; front = front + terms; kend = front;}
+    else {kend = back; back = back - terms; kstart = back;}
+    return true;
+  }
+};
+
+const long long gpuFirstChunk = 1 << 20; // Before a device has been timed, and the smallest chunk it takes otherwise
+const double gpuChunkSeconds = 0.25; // Time a GPU chunk should take, long enough to hide the launch and copy overhead
+const long long cpuChunk = 10000; // CPU threads take small chunks so they don't hold up the end of the series
+int cpuThreads;
+
+// CPU threads when none are asked for, for the command line and the library alike. A core is left for each device's host
+// thread, and without a device there is always one
+int defaultCpuThreads(int deviceCount)
+{
+  int hardware = static_cast<int>(std::thread::hardware_concurrency());
+  return hardware > deviceCount ? hardware - deviceCount : (deviceCount == 0 ? 1 : 0);
+}
+
+// Profiling - with --profile the profiler has a row for each phase of each series, its counters count the device host
+// threads and CPU threads too. The devices' own time in the kernel, the reduction kernel and the copy back comes from the
+// HIP events around them
+const int seriesCount = 4;
+const int seriesJ[seriesCount] = {1, 4, 5, 6};
+
+// The profiler's row for phase p of series j
+int profileRow(int j, ProfilePhase p)
+{
+  int series = 0;
+  while (series < seriesCount - 1 && seriesJ[series] != j) {series++;}
+  return series * phaseCount + p;
+}
+
+std::vector<std::string> profileRows()
+{
+  std::vector<std::string> rows;
+  for (int series = 0; series < seriesCount; series++)
+  {
+    for (int p = 0; p < phaseCount; p++) {rows.push_back("S" + std::to_string(seriesJ[series]) + " " + phaseNames[p]);}
+  }
+  return rows;
+}
+
+void profileReport(std::ostream &out)
+{
+  if (!profiler.enabled) {return;}
+  profiler.report(out, "Profile (host user space, all threads):");
+  for (size_t i = 0; i < devices.size(); i++)
+  {
+    out << "  Device " << i << ": kernel " << devices[i].kernelMs / 1000. << " s, reduction kernel " << devices[i].reduceMs / 1000.
+    << " s, hipMemcpy " << devices[i].copyMs / 1000. << " s over " << devices[i].shards << " shards" << std::endl;
+  }
+}
+
+// Host thread's share of a series on one device, chunks from the front until the queue runs out. The next chunk is taken and
+// queued on the device before the last one is waited for, so the device isn't left idle between them
+double gpuSeries(GpuDevice &dev, WorkQueue &queue, int j, int d, size_t slot)
+{
+  double s = 0;
+  long long gridThreads = static_cast<long long>(dev.config.blocks) * dev.config.threadsPerBlock;
+  long long want = gpuFirstChunk;
+  bool inFlight = false; // Whether the other buffer holds a queued shard
+  for (int b = 0;; b = 1 - b)
+  {
+    ShardBuffer &buf = dev.buffers[b];
+    bool more = queue.take(want, gridThreads, true, buf.kstart, buf.kend);
+    if (more) {launchShard(dev, b, j, d);}
+    if (inFlight)
+    {
+      const ShardBuffer &last = dev.buffers[1 - b];
+      s = s + finishShard(dev, 1 - b);
+      s = s - floor(s);
+      progress.count(slot, last.kend - last.kstart);
+      want = static_cast<long long>(dev.throughput * gpuChunkSeconds);
+      if (want < gpuFirstChunk) {want = gpuFirstChunk;}
+    }
+    if (!more) {break;}
+    inFlight = true;
+  }
+  return s;
 }
 
+// CPU thread's share of a series, chunks from the back computed on the host until the queue runs out
+double cpuSeries(WorkQueue &queue, int j, int d, size_t slot)
+{
+  double s = 0;
+  long long kstart, kend;
+  while (queue.take(cpuChunk, 1, false, kstart, kend))
+  {
+    s = s + leftPortionThreaded(static_cast<int>(kend - kstart), static_cast<int>(kstart), j, d);
+    s = s - floor(s);
+    progress.count(slot, kend - kstart);
+  }
+  return s;
+}
+
+// Host threads for the Left Portion, one driving each device and then the CPU threads. They are started once and kept for
+// every series and position, as the CPU program's pool, so each series only sets up its WorkQueue and wakes them. One
+// series runs at a time
+class SeriesWorkers
+{
+  public:
+    explicit SeriesWorkers(int cpuWorkers)
+    {
+      for (size_t i = 0; i < devices.size() + cpuWorkers; i++) {threads.push_back(std::thread(&SeriesWorkers::workerLoop, this, i));}
+    }
+
+    ~SeriesWorkers()
+    {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+      }
+      wake.notify_all();
+      for (size_t i = 0; i < threads.size(); i++) {threads[i].join();}
+    }
+
+    // Series j at d from queue on every device and the first cpuThreads CPU workers, results[i] gets worker i's sum
+    void run(WorkQueue &queue, int j, int d, double *results)
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      size_t cpuWorkers = threads.size() - devices.size();
+      job = Job{&queue, j, d, results};
+      active = devices.size() + std::min(static_cast<size_t>(cpuThreads), cpuWorkers);
+      running = active;
+      generation++;
+      wake.notify_all();
+      finished.wait(guard, [this]{ return running == 0; });
+    }
+
+  private:
+    struct Job
+    {
+      WorkQueue *queue;
+      int j, d;
+      double *results;
+    };
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wake; // Signalled when a series starts or the workers are stopping
+    std::condition_variable finished; // Signalled when the last worker of a series is done
+    Job job = Job();
+    size_t active = 0, running = 0; // Workers taking part in the current series, and those not yet done
+    long long generation = 0; // Count of series started
+    bool stopping = false;
+
+    void workerLoop(size_t index)
+    {
+      long long seen = 0;
+      std::unique_lock<std::mutex> guard(lock);
+      for (;;)
+      {
+        wake.wait(guard, [this, &seen]{ return stopping || generation != seen; });
+        if (stopping) {return;}
+        seen = generation;
+        if (index >= active) {continue;} // A CPU worker beyond this series' cpuThreads
+        Job series = job;
+        guard.unlock();
+        double s = index < devices.size() ? gpuSeries(devices[index], *series.queue, series.j, series.d, index) : cpuSeries(*series.queue, series.j, series.d, index);
+        series.results[index] = s;
+        guard.lock();
+        if (--running == 0) {finished.notify_all();}
+      }
+    }
+};
+SeriesWorkers *seriesWorkers; // Created once in main (or by the library engine) and shared by every series and position
+
+// Wall time of the phases of the last series, filled in when the benchmark sets phaseTimes
+struct PhaseTimes
+{
+  double left = 0, right = 0;
+};
+PhaseTimes *phaseTimes = nullptr;
+
+const double rightPortionBound = std::ldexp(1., -std::numeric_limits<double>::digits);
+
 // Bailey–Borwein–Plouffe Formula 16^d x Sj
 double bbpf16jsd(int j, int d)
   {
     double s = .0;
     double numerator,denominator;
     double term;
-    int blocks = 80;
-    int threadsPerBlock = 60;
-    int noOfThreads= blocks * threadsPerBlock;
-    int perThreadRuns = 2000;
-    double threadResults[noOfThreads]; // For storing results from threads
-    double *gpu_threadResults;
-    hipMalloc(&gpu_threadResults,noOfThreads*sizeof(double));
-
-    // Left Portion
-    int k = 0;
-    while (k < d)
-    {
-      if (k + (perThreadRuns*noOfThreads) < d) // Only make threads for k up to less than d
-      {
-        // Launch HIP Kernel, then copy results from GPU to CPU
-        hipLaunchKernelGGL(kern,dim3(blocks),dim3(threadsPerBlock),0,0,gpu_threadResults,perThreadRuns,j,d,k);
-        hipMemcpy(threadResults,gpu_threadResults,noOfThreads*sizeof(double),hipMemcpyDefault);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-        k = k + perThreadRuns*noOfThreads; // We need to run (perThreadRuns) results on each thread because the thread overhead is much to great to run just 1
-        for (int i2 = 0; i2 < noOfThreads;i2++)
-        {
-          s = s + gpu_threadResults[i2];
-          s = s - static_cast<int>(s);
-        }
-      } else // If we are almost done and k + noOfThreads > d then do the last few terms single threaded
-      {
-        denominator = 8 * k + j;
-        numerator = expoMod(d - k, denominator); // Binary algorithm for exponentiation with Modulo must be used becuase otherwise 16^(d-k) can be very large and overflows
-        term = numerator/denominator;
-        s = s + term;
-        s = s - static_cast<int>(s);
-        k++;
-      }
+    // Left Portion, every device and CPU thread takes chunks from the same queue
+    WorkQueue queue;
+    queue.back = d;
+    if (progress.interval > 0)
+    {
+      long long done = 0;
+      for (size_t i = 0; i < progress.counters.size(); i++) {done = done + progress.counters[i].terms.load(std::memory_order_relaxed);}
+      progress.seriesStart.store(done, std::memory_order_relaxed);
+      progress.seriesTerms.store(d, std::memory_order_relaxed);
+      progress.series.store(j, std::memory_order_relaxed);
+    }
+    profiler.start();
+    std::vector<double> results(devices.size() + cpuThreads, 0.);
+    seriesWorkers->run(queue, j, d, &results[0]);
+    profiler.phase(profileRow(j, phaseLeft));
+    for (size_t i = 0; i < results.size(); i++)
+    {
+      s = s + results[i];
+      s = s - floor(s);
     }
-    // Right Portion
-    for (int k = d; k <= d+100; k++)
+    profiler.phase(profileRow(j, phaseReduction));
+    std::chrono::steady_clock::time_point leftDone = std::chrono::steady_clock::now();
+    // Right Portion, 16^(d-k) is a running product as division by 16 is exact. The terms stop once they are below half an
+    // ulp of a double sum in [0, 1)
+    numerator = 1;
+    for (int k = d;; k++)
     {
-      numerator = pow(16, d - k);
-      denominator = 8 * k + j;
+      denominator = 8. * k + j;
       term = numerator/denominator;
-      if (term<1e-17) {break;}
+      if (term < rightPortionBound) {break;}
       s = s + term;
       s = s - static_cast<int>(s);
+      numerator = numerator / 16.;
+    }
+    profiler.phase(profileRow(j, phaseRight));
+    if (phaseTimes)
+    {
+      phaseTimes->left = std::chrono::duration<double>(leftDone - start).count();
+      phaseTimes->right = std::chrono::duration<double>(std::chrono::steady_clock::now() - leftDone).count();
     }
     return s;
   }
@@ -160,19 +645,485 @@ void toHex(char *out, double *in)
   }
 }
 
+// Bound on how far the computed 16^d pi mod 1 is from the true value, as in the CPU version. Every term, on a device or a
+// CPU thread, is an exact residue divided by its denominator and added mod 1, within 1.5u of exact where u is half an ulp
+// of a double in [1, 2). Each merge of two partial sums (per thread, block tree, device and CPU thread) is within u, and
+// merging an empty one is exact so there are fewer merges than terms. With the Right Portion and its omitted tail each
+// series is within 3u(d + 16), and 4S1 - 2S4 - S5 - S6 within 8 times that plus 16u for its own rounding
+double errorBound(int d)
+{
+  double u = std::ldexp(1., -std::numeric_limits<double>::digits);
+  return (24.*(d + 16) + 16)*u;
+}
+
+// The fp64 residues are exact while the product of two, up to (8d+6)^2, fits in a double. Past that only the int32
+// kernel's are, so every device has to be using it with no CPU threads
+bool exactResidues(int d)
+{
+  double k = 8.*d + 6;
+  if (k*k < std::ldexp(1., std::numeric_limits<double>::digits)) {return true;}
+  if (cpuThreads > 0 || devices.empty() || 8LL * d + 6 >= int32Limit) {return false;}
+  for (size_t i = 0; i < devices.size(); i++) {if (devices[i].config.kernel != "int32") {return false;}}
+  return true;
+}
+
+// The hex digits of piDec at placeNo that every value within the error bound shares, so are those of the true value
+void guaranteedHex(char *out, double piDec, int placeNo)
+{
+  double bound = errorBound(placeNo) + std::ldexp(1., -51); // Plus the rounding of the two ends themselves
+  double low = piDec - bound, high = piDec + bound;
+  toHex(out, &piDec);
+  char lowHex[] = "000000000", highHex[] = "000000000";
+  int n = 0;
+  if (exactResidues(placeNo) && std::floor(low) == std::floor(high)) // An interval across a whole number differs in the first digit
+  {
+    toHex(lowHex, &low);
+    toHex(highHex, &high);
+    while (n < 9 && lowHex[n] == highHex[n]) {n++;}
+  }
+  out[n] = '\0';
+}
+
+// Launch profiles are kept per device name, in the home directory so that every run finds them
+std::string profilePath(const hipDeviceProp_t &device)
+{
+  std::string name = device.name;
+  for (size_t i = 0; i < name.size(); i++)
+  {
+    if (!std::isalnum(static_cast<unsigned char>(name[i]))) {name[i] = '_';}
+  }
+  const char *home = std::getenv("HOME");
+  return (home ? std::string(home) + "/" : std::string()) + ".bbp-pi-parallel-gpu-" + name + ".profile";
+}
+
+bool loadProfile(const std::string &path, LaunchConfig &config)
+{
+  std::ifstream file(path);
+  LaunchConfig loaded;
+  if (!(file >> loaded.blocks >> loaded.threadsPerBlock >> loaded.perThreadRuns)) {return false;}
+  if (loaded.blocks < 1 || loaded.threadsPerBlock < 1 || loaded.threadsPerBlock > maxThreadsPerBlock || loaded.perThreadRuns < 1) {return false;}
+  std::string kernel;
+  if (file >> kernel) // Profiles saved before the int32 kernel don't have one
+  {
+    if (kernel != "fp64" && kernel != "int32") {return false;}
+    loaded.kernel = kernel;
+  }
+  config = loaded;
+  return true;
+}
+
+bool saveProfile(const std::string &path, const LaunchConfig &config)
+{
+  std::ofstream file(path);
+  file << config.blocks << " " << config.threadsPerBlock << " " << config.perThreadRuns << " " << config.kernel << std::endl;
+  return static_cast<bool>(file);
+}
+
+// Time one series at a short position on the device alone for a sweep of launch configurations built from its compute units
+// and wavefront size, with both kernels, and return the quickest
+LaunchConfig autoTune(GpuDevice &dev)
+{
+  const int tuneD = 2000000;
+  const hipDeviceProp_t &device = dev.props;
+  int warp = device.warpSize > 0 ? device.warpSize : 64;
+  int threadLimit = device.maxThreadsPerBlock > 0 && device.maxThreadsPerBlock < maxThreadsPerBlock ? device.maxThreadsPerBlock : maxThreadsPerBlock;
+  int units = device.multiProcessorCount > 0 ? device.multiProcessorCount : 1;
+  const int blockFactors[] = {1, 2, 4, 8, 16};
+  const int warpFactors[] = {1, 2, 4, 8, 16};
+  const int runs[] = {250, 1000, 4000};
+  const char *kernels[] = {"fp64", "int32"};
+  LaunchConfig best = dev.config;
+  double bestTime = -1;
+  dev.buffers[0].kstart = 0;
+  dev.buffers[0].kend = tuneD;
+  launchShard(dev, 0, 1, tuneD); // Warm up, the first launch includes loading the code object
+  finishShard(dev, 0);
+  for (int kn = 0; kn < 2; kn++)
+  {
+    dev.config.kernel = kernels[kn];
+    for (int b = 0; b < 5; b++)
+    {
+      for (int t = 0; t < 5; t++)
+      {
+        if (warp * warpFactors[t] > threadLimit) {continue;}
+        for (int r = 0; r < 3; r++)
+        {
+          dev.config.blocks = units * blockFactors[b];
+          dev.config.threadsPerBlock = warp * warpFactors[t];
+          dev.config.perThreadRuns = runs[r];
+          std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+          launchShard(dev, 0, 1, tuneD);
+          finishShard(dev, 0);
+          double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+          std::cout << "  " << dev.config.kernel << ", blocks " << dev.config.blocks << ", threadsPerBlock " << dev.config.threadsPerBlock << ", perThreadRuns " << dev.config.perThreadRuns << ": " << time << " s" << std::endl;
+          if (bestTime < 0 || time < bestTime) {bestTime = time; best = dev.config;}
+        }
+      }
+    }
+  }
+  dev.config = best;
+  return best;
+}
+
+// Parse BLOCKS:THREADS:RUNS or BLOCKS:THREADS:RUNS:KERNEL
+bool parseConfig(const std::string &item, LaunchConfig &config)
+{
+  std::stringstream fields(item);
+  char colon1, colon2;
+  if (!(fields >> config.blocks >> colon1 >> config.threadsPerBlock >> colon2 >> config.perThreadRuns) || colon1 != ':' || colon2 != ':') {return false;}
+  if (config.blocks < 1 || config.threadsPerBlock < 1 || config.threadsPerBlock > maxThreadsPerBlock || config.perThreadRuns < 1) {return false;}
+  std::string kernel;
+  if (std::getline(fields, kernel) && !kernel.empty())
+  {
+    if (kernel != ":fp64" && kernel != ":int32") {return false;}
+    config.kernel = kernel.substr(1);
+  }
+  return true;
+}
+
+// Benchmark mode - every position with every launch configuration (on every device) and CPU thread count, (trials) times each,
+// as CSV of the median and standard deviation of the left and right portion of each series
+int runBenchmark(const std::vector<int> &positions, const std::vector<LaunchConfig> &configs, const std::vector<int> &threadCounts, int trials, const std::string &csvPath)
+{
+  std::ofstream file;
+  if (!csvPath.empty())
+  {
+    file.open(csvPath);
+    if (!file) {std::cerr << "Can't write " << csvPath << std::endl; return 1;}
+  }
+  std::ostream &csv = csvPath.empty() ? std::cout : file;
+  csv << "position,cpu_threads,kernel,blocks,threads_per_block,per_thread_runs,hex,series,phase,trials,median_s,stddev_s" << std::endl;
+  int mainThreads = cpuThreads;
+  for (size_t c = 0; c < configs.size(); c++)
+  {
+    for (size_t i = 0; i < devices.size(); i++) {devices[i].config = configs[c];}
+    for (size_t t = 0; t < threadCounts.size(); t++)
+    {
+      cpuThreads = threadCounts[t];
+      for (size_t p = 0; p < positions.size(); p++)
+      {
+        int d = positions[p] - 1;
+        std::vector<double> left[4], right[4], total;
+        double piDec = 0;
+        for (int trial = 0; trial < trials; trial++)
+        {
+          double sj[4];
+          double sum = 0;
+          for (int l = 0; l < 4; l++)
+          {
+            PhaseTimes times;
+            phaseTimes = &times;
+            sj[l] = bbpf16jsd(seriesJ[l], d);
+            phaseTimes = nullptr;
+            left[l].push_back(times.left);
+            right[l].push_back(times.right);
+            sum = sum + times.left + times.right;
+          }
+          total.push_back(sum);
+          piDec = (4.*sj[0])-(2.*sj[1])-sj[2]-sj[3]; // As bbpfCalc
+          piDec = piDec - static_cast<int>(piDec) + 1.;
+        }
+        char hexOutput[] = "000000000";
+        guaranteedHex(hexOutput, piDec, positions[p] - 1);
+        const LaunchConfig &config = configs[c];
+        std::ostringstream row;
+        row << positions[p] << "," << cpuThreads << "," << config.kernel << "," << config.blocks << "," << config.threadsPerBlock << "," << config.perThreadRuns << "," << hexOutput << ",";
+        double median, stddev;
+        for (int l = 0; l < 4; l++)
+        {
+          summarise(left[l], median, stddev);
+          csv << row.str() << "S" << seriesJ[l] << ",left," << trials << "," << median << "," << stddev << std::endl;
+          summarise(right[l], median, stddev);
+          csv << row.str() << "S" << seriesJ[l] << ",right," << trials << "," << median << "," << stddev << std::endl;
+        }
+        summarise(total, median, stddev);
+        csv << row.str() << "all,total," << trials << "," << median << "," << stddev << std::endl;
+        if (!csvPath.empty()) {std::cout << "Position: " << positions[p] << " " << config.kernel << " " << config.blocks << ":" << config.threadsPerBlock << ":" << config.perThreadRuns << " CPU Threads: " << cpuThreads << " Median: " << median << " s" << std::endl;}
+      }
+    }
+  }
+  cpuThreads = mainThreads;
+  return 0;
+}
+
+// Service mode - as the CPU program's, one JSON query per line on stdin such as {"id": 7, "position": 1000000}, answered
+// on stdout with {"id": 7, "position": 1000000, "hex": "26C65E", "seconds": 0.05} or an "error". Each query already
+// fills every device, so they are answered in turn
+int runServe()
+{
+  for (std::string line; std::getline(std::cin, line);)
+  {
+    if (line.find_first_not_of(" \t\r") == std::string::npos) {continue;}
+    std::map<std::string, std::string> fields;
+    if (!parseJsonObject(line, fields)) {std::cout << "{\"id\": null, \"error\": \"Bad request\"}" << std::endl; continue;}
+    std::string id = fields.count("id") ? fields["id"] : "null";
+    long long position = fields.count("position") ? std::atoll(jsonUnquote(fields["position"]).c_str()) : 0;
+    std::cout << "{\"id\": " << id << ", \"position\": " << position;
+    if (position < 1 || position > std::numeric_limits<int>::max()) {std::cout << ", \"error\": \"Bad position\"}" << std::endl; continue;}
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int placeNo = static_cast<int>(position - 1);
+    double piDec;
+    bbpfCalc(&piDec, &placeNo);
+    char hexOutput[] = "000000000";
+    guaranteedHex(hexOutput, piDec, placeNo);
+    std::cout << ", \"hex\": \"" << hexOutput << "\", \"seconds\": " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "}" << std::endl;
+  }
+  return 0;
+}
+
+}
+
+// Library interface, see bbp-pi-parallel.h. Every device is set up with its saved profile once, a position already uses
+// all of them so queries take turns. The engine's workers are the ones seriesWorkers points to, as main's are
+struct BbpEngine::State
+{
+  std::mutex queryMutex;
+  SeriesWorkers workers;
+  explicit State(int cpuWorkers) : workers(cpuWorkers) {}
+};
+
+BbpEngine::BbpEngine(unsigned threads, const std::string &cachePath)
+{
+  (void)cachePath; // Only the CPU program has the result cache
+  int deviceCount = 0;
+  if (hipGetDeviceCount(&deviceCount) != hipSuccess || deviceCount < 0) {deviceCount = 0;}
+  devices.resize(deviceCount);
+  for (int i = 0; i < deviceCount; i++)
+  {
+    setupDevice(devices[i], i);
+    loadProfile(profilePath(devices[i].props), devices[i].config);
+  }
+  cpuThreads = threads > 0 ? static_cast<int>(threads) : defaultCpuThreads(deviceCount);
+  progress.counters = std::vector<TermCounter>(devices.size() + cpuThreads);
+  state = new State(cpuThreads);
+  seriesWorkers = &state->workers;
+}
+
+BbpEngine::~BbpEngine()
+{
+  seriesWorkers = nullptr;
+  delete state;
+  for (size_t i = 0; i < devices.size(); i++) {releaseDevice(devices[i]);}
+  devices.clear();
+}
+
+DigitResult BbpEngine::hexDigits(int64_t position, const EngineOptions &options)
+{
+  (void)options;
+  DigitResult result;
+  if (position < 1 || position > std::numeric_limits<int>::max()) {result.engine = "Positions are from 1 to " + std::to_string(std::numeric_limits<int>::max()); return result;}
+  std::lock_guard<std::mutex> lock(state->queryMutex);
+  int placeNo = static_cast<int>(position - 1);
+  double piDec;
+  bbpfCalc(&piDec, &placeNo);
+  char hexOutput[] = "000000000";
+  guaranteedHex(hexOutput, piDec, placeNo);
+  result.ok = true;
+  result.hex = hexOutput;
+  result.engine = std::to_string(devices.size()) + " HIP Devices, " + std::to_string(cpuThreads) + " CPU Threads, Precision: double";
+  return result;
+}
+
+#ifndef BBP_PI_PARALLEL_LIBRARY
 int main(int argc, char *argv[]) {
-  std::cout << "Bailey–Borwein–Plouffe Formula for Pi" << std::endl;
-  std::cout << "Built: " << __DATE__ << " " << __TIME__ << " with HIP Version: " << HIP_VERSION_MAJOR << "." << HIP_VERSION_MINOR << "." << HIP_VERSION_PATCH << std::endl << std::endl;
-  hipDeviceProp_t GPUdevice; hipGetDeviceProperties(&GPUdevice, 0);
-  std::wcout << "-------- Detected HIP Device Details --------" << std::endl
-  << "          Name: " << GPUdevice.name << std::endl
-  << "     Total RAM: " << GPUdevice.totalGlobalMem/pow(1024,2) << " (MB)" << std::endl // RAM is shown is MB output from API is bytes
-  << " Compute Units: " << GPUdevice.multiProcessorCount << std::endl << std::endl;
-  int placeNo = (argc >= 2) && (std::atoi(argv[1]) > 0) ? std::atoi(argv[1]) - 1 : 10000000 - 1; // Accurate to 10000000
+  bool serve = false;
+  bool csvOnStdout = false;
+  for (int i = 1; i < argc; i++)
+  {
+    if (std::string(argv[i]) == "--serve") {serve = true;}
+    if (std::string(argv[i]) == "--benchmark") {csvOnStdout = true;}
+  }
+  for (int i = 1; i < argc; i++) {if (std::string(argv[i]).compare(0, 16, "--benchmark-csv=") == 0) {csvOnStdout = false;}}
+  std::ostream &info = serve || csvOnStdout ? std::cerr : std::cout; // Serving or a CSV on stdout leaves it for those
+  std::wostream &winfo = serve || csvOnStdout ? std::wcerr : std::wcout;
+  info << "Bailey–Borwein–Plouffe Formula for Pi" << std::endl;
+  info << "Built: " << __DATE__ << " " << __TIME__ << " with HIP Version: " << HIP_VERSION_MAJOR << "." << HIP_VERSION_MINOR << "." << HIP_VERSION_PATCH << std::endl << std::endl;
+  int deviceCount = 0;
+  if (hipGetDeviceCount(&deviceCount) != hipSuccess || deviceCount < 0) {deviceCount = 0;}
+  devices.resize(deviceCount);
+  winfo << "-------- Detected HIP Device Details --------" << std::endl;
+  if (deviceCount == 0) {winfo << "No HIP devices found" << std::endl << std::endl;}
+  for (int i = 0; i < deviceCount; i++)
+  {
+    setupDevice(devices[i], i);
+    const hipDeviceProp_t &GPUdevice = devices[i].props;
+    winfo << "        Device: " << i << std::endl
+    << "          Name: " << GPUdevice.name << std::endl
+    << "     Total RAM: " << GPUdevice.totalGlobalMem/pow(1024,2) << " (MB)" << std::endl // RAM is shown is MB output from API is bytes
+    << " Compute Units: " << GPUdevice.multiProcessorCount << std::endl << std::endl;
+  }
+  // Batch mode - positions from --positions=LIST or --positions-file=FILE share the device setup above
+  std::vector<int> batchPositions;
+  std::vector<char *> positional;
+  bool tune = false;
+  std::string kernel; // Overrides the profiles when set
+  bool benchmark = false;
+  std::vector<int> benchmarkPositions;
+  std::vector<LaunchConfig> benchmarkConfigs;
+  std::vector<int> benchmarkThreads;
+  int benchmarkTrials = 3;
+  std::string benchmarkCsv;
+  bool profiling = false;
+  unsigned long long profileFpEvent = 0; // 0 for the vendor's default
+  cpuThreads = defaultCpuThreads(deviceCount);
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--autotune") {tune = true;}
+    else if (arg == "--serve") {} // Already seen
+    else if (arg.compare(0, 9, "--kernel=") == 0)
+    {
+      kernel = arg.substr(9);
+      if (kernel != "fp64" && kernel != "int32") {std::cerr << "Unknown kernel: " << kernel << std::endl; return 1;}
+    }
+    else if (arg.compare(0, 11, "--progress=") == 0) {progress.interval = std::atof(arg.c_str() + 11);}
+    else if (arg.compare(0, 16, "--progress-json=") == 0) {progress.jsonPath = arg.substr(16);}
+    else if (arg == "--benchmark") {benchmark = true;}
+    else if (arg == "--profile") {profiling = true;}
+    else if (arg.compare(0, 19, "--profile-fp-event=") == 0) {profiling = true; profileFpEvent = std::strtoull(arg.c_str() + 19, nullptr, 0);}
+    else if (arg.compare(0, 22, "--benchmark-positions=") == 0)
+    {
+      std::stringstream list(arg.substr(22));
+      for (std::string item; std::getline(list, item, ',');)
+      {
+        if (!parsePositions(item, benchmarkPositions)) {std::cerr << "Bad position: " << item << std::endl; return 1;}
+      }
+    }
+    else if (arg.compare(0, 20, "--benchmark-configs=") == 0)
+    {
+      std::stringstream list(arg.substr(20));
+      for (std::string item; std::getline(list, item, ',');)
+      {
+        LaunchConfig config;
+        if (!parseConfig(item, config)) {std::cerr << "Bad launch configuration: " << item << std::endl; return 1;}
+        benchmarkConfigs.push_back(config);
+      }
+    }
+    else if (arg.compare(0, 24, "--benchmark-cpu-threads=") == 0)
+    {
+      std::stringstream list(arg.substr(24));
+      for (std::string item; std::getline(list, item, ',');)
+      {
+        if (item.empty() || std::atoi(item.c_str()) < 0) {std::cerr << "Bad thread count: " << item << std::endl; return 1;}
+        benchmarkThreads.push_back(std::atoi(item.c_str()));
+      }
+    }
+    else if (arg.compare(0, 19, "--benchmark-trials=") == 0) {benchmarkTrials = std::atoi(arg.c_str() + 19) > 0 ? std::atoi(arg.c_str() + 19) : 1;}
+    else if (arg.compare(0, 16, "--benchmark-csv=") == 0) {benchmarkCsv = arg.substr(16);}
+    else if (arg.compare(0, 14, "--cpu-threads=") == 0)
+    {
+      cpuThreads = std::atoi(arg.c_str() + 14);
+      if (cpuThreads < 0) {std::cerr << "Bad thread count: " << arg.substr(14) << std::endl; return 1;}
+    }
+    else if (arg.compare(0, 12, "--positions=") == 0 || arg.compare(0, 17, "--positions-file=") == 0)
+    {
+      std::vector<std::string> items;
+      if (arg[11] == '=') // A comma separated list
+      {
+        std::stringstream list(arg.substr(12));
+        for (std::string item; std::getline(list, item, ',');) {items.push_back(item);}
+      } else // A file of whitespace separated items
+      {
+        std::ifstream file(arg.substr(17));
+        if (!file) {std::cerr << "Can't open " << arg.substr(17) << std::endl; return 1;}
+        for (std::string item; file >> item;) {items.push_back(item);}
+      }
+      for (size_t l = 0; l < items.size(); l++)
+      {
+        if (!parsePositions(items[l], batchPositions)) {std::cerr << "Bad position: " << items[l] << std::endl; return 1;}
+      }
+    }
+    else {positional.push_back(argv[i]);}
+  }
+  if (tune)
+  {
+    if (devices.empty()) {std::cerr << "No HIP devices to tune" << std::endl; return 1;}
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+      std::string profile = profilePath(devices[i].props);
+      std::cout << "Tuning launch configuration for device " << i << std::endl;
+      LaunchConfig best = autoTune(devices[i]);
+      std::cout << "Best: " << best.kernel << ", blocks " << best.blocks << ", threadsPerBlock " << best.threadsPerBlock << ", perThreadRuns " << best.perThreadRuns << std::endl;
+      if (!saveProfile(profile, best)) {std::cerr << "Can't write " << profile << std::endl; return 1;}
+      std::cout << "Saved to " << profile << std::endl;
+    }
+    return 0;
+  }
+  for (size_t i = 0; i < devices.size(); i++)
+  {
+    std::string profile = profilePath(devices[i].props);
+    bool profiled = loadProfile(profile, devices[i].config);
+    if (!kernel.empty()) {devices[i].config.kernel = kernel;}
+    const LaunchConfig &config = devices[i].config;
+    info << "Launch Configuration (device " << i << "): " << config.kernel << ", blocks " << config.blocks << ", threadsPerBlock " << config.threadsPerBlock << ", perThreadRuns " << config.perThreadRuns << (profiled ? " (from " + profile + ")" : std::string(" (default)")) << std::endl;
+  }
+  if (devices.empty() && cpuThreads == 0) {std::cerr << "No HIP devices and no CPU threads to run on" << std::endl; return 1;}
+  info << "CPU Threads: " << cpuThreads << std::endl;
+  if (profiling) {profiler.open(profileFpEvent, profileRows());} // Before the worker threads, so they're counted
+  struct ProfileReport { ~ProfileReport() { profileReport(std::cerr); } } profileReport; // However main returns
+  if (benchmark)
+  {
+    if (benchmarkPositions.empty()) {for (int p = 100000; p <= 100000000; p = p * 10) {benchmarkPositions.push_back(p);}}
+    if (benchmarkConfigs.empty() && !devices.empty()) // The first device's configuration with each kernel
+    {
+      LaunchConfig config = devices[0].config;
+      config.kernel = "fp64";
+      benchmarkConfigs.push_back(config);
+      config.kernel = "int32";
+      benchmarkConfigs.push_back(config);
+    }
+    if (benchmarkConfigs.empty()) {benchmarkConfigs.push_back(LaunchConfig());}
+    if (benchmarkThreads.empty()) // The GPUs alone, then with the CPU threads
+    {
+      if (!devices.empty()) {benchmarkThreads.push_back(0);}
+      if (cpuThreads > 0) {benchmarkThreads.push_back(cpuThreads);}
+    }
+    int maxThreads = *std::max_element(benchmarkThreads.begin(), benchmarkThreads.end());
+    if (devices.empty() && std::find(benchmarkThreads.begin(), benchmarkThreads.end(), 0) != benchmarkThreads.end()) {std::cerr << "No HIP devices, so CPU threads can't be 0" << std::endl; return 1;}
+    progress.counters = std::vector<TermCounter>(devices.size() + maxThreads);
+    progress.interval = 0;
+    SeriesWorkers workers(maxThreads); // Every thread count of the benchmark uses the first of its CPU workers
+    seriesWorkers = &workers;
+    int status = runBenchmark(benchmarkPositions, benchmarkConfigs, benchmarkThreads, benchmarkTrials, benchmarkCsv);
+    for (size_t i = 0; i < devices.size(); i++) {releaseDevice(devices[i]);}
+    return status;
+  }
+  if (!progress.jsonPath.empty() && progress.interval <= 0) {progress.interval = 10;}
+  progress.counters = std::vector<TermCounter>(devices.size() + cpuThreads);
+  SeriesWorkers workers(cpuThreads);
+  seriesWorkers = &workers;
+  if (serve)
+  {
+    ProgressReporter reporter;
+    int status = runServe();
+    for (size_t i = 0; i < devices.size(); i++) {releaseDevice(devices[i]);}
+    return status;
+  }
+  int placeNo = (positional.size() >= 1) && (std::atoi(positional[0]) > 0) ? std::atoi(positional[0]) - 1 : 10000000 - 1; // Accurate to 10000000
+  if (!batchPositions.empty()) {for (size_t i = 0; i < batchPositions.size(); i++) {progress.planned = progress.planned + 4LL * (batchPositions[i] - 1);}}
+  else {progress.planned = 4LL * placeNo;}
+  ProgressReporter reporter;
+  if (!batchPositions.empty())
+  {
+    std::cout << "Calculating " << batchPositions.size() << " Positions" << std::endl;
+    for (size_t i = 0; i < batchPositions.size(); i++) // Each series already fills every device and CPU thread, so positions run one after another
+    {
+      int batchPlace = batchPositions[i] - 1;
+      double piDec;
+      bbpfCalc(&piDec, &batchPlace);
+      char hexOutput[] = "000000000";
+      guaranteedHex(hexOutput, piDec, batchPlace);
+      std::cout << "Position: " << batchPositions[i] << " Hex: " << (hexOutput[0] ? hexOutput : "(none guaranteed)") << std::endl;
+    }
+    for (size_t i = 0; i < devices.size(); i++) {releaseDevice(devices[i]);}
+    return 0;
+  }
   std::cout << "Calculating Position: " << (placeNo + 1) << std::endl;
   double piDec;
   bbpfCalc(&piDec, &placeNo);
   char hexOutput[] = "000000000";
-  toHex(hexOutput, &piDec);
-  std::cout << "Pi Estimation Hex: " << hexOutput << std::endl;
+  guaranteedHex(hexOutput, piDec, placeNo);
+  std::cout << "Pi Estimation Hex: " << (hexOutput[0] ? hexOutput : "(none guaranteed)") << std::endl;
+  for (size_t i = 0; i < devices.size(); i++) {releaseDevice(devices[i]);}
 }
+#endif
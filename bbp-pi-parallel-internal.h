@@ -0,0 +1,364 @@
+// Parallel Implementation of the Bailey–Borwein–Plouffe Formula for Pi (Shared Internals)
+// Copyright (C) 2023 J. Madgwick
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Helpers both programs use, not part of the library interface. Like the rest of each program they have internal linkage,
+// so a program built against the library only sees BbpEngine
+
+#ifndef BBP_PI_PARALLEL_INTERNAL_H
+#define BBP_PI_PARALLEL_INTERNAL_H
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#if defined(__linux__)
+// Hardware counters for --profile
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Add the positions in one list item, either N or START-END:STEP (step defaults to 1), returns false if it doesn't parse
+// or goes past what Position holds
+template <typename Position> bool parsePositions(const std::string &item, std::vector<Position> &positions)
+{
+  char *end;
+  long long start = std::strtoll(item.c_str(), &end, 10);
+  if (end == item.c_str() || start < 1) {return false;}
+  long long last = start, step = 1;
+  if (*end == '-')
+  {
+    const char *rest = end + 1;
+    last = std::strtoll(rest, &end, 10);
+    if (end == rest || last < start) {return false;}
+    if (*end == ':')
+    {
+      rest = end + 1;
+      step = std::strtoll(rest, &end, 10);
+      if (end == rest || step < 1) {return false;}
+    }
+  }
+  if (*end != '\0' || last > static_cast<long long>(std::numeric_limits<Position>::max())) {return false;}
+  for (long long p = start; p <= last; p = p + step) {positions.push_back(static_cast<Position>(p));}
+  return true;
+}
+
+// Median and sample standard deviation of repeated timings
+inline void summarise(std::vector<double> times, double &median, double &stddev)
+{
+  std::sort(times.begin(), times.end());
+  size_t n = times.size();
+  median = n % 2 ? times[n/2] : (times[n/2 - 1] + times[n/2]) / 2;
+  double mean = 0;
+  for (size_t i = 0; i < n; i++) {mean = mean + times[i] / n;}
+  double squares = 0;
+  for (size_t i = 0; i < n; i++) {squares = squares + (times[i] - mean) * (times[i] - mean);}
+  stddev = n > 1 ? std::sqrt(squares / (n - 1)) : 0;
+}
+
+// Service mode's JSON, one flat object per line
+
+// A JSON string or a bare value (number, true, false or null) starting at in[i], written to token as it was in the line
+inline bool jsonToken(const std::string &in, size_t &i, std::string &token)
+{
+  size_t start = i;
+  if (i < in.size() && in[i] == '"')
+  {
+    for (i++; i < in.size() && in[i] != '"'; i++) {if (in[i] == '\\') {i++;}}
+    if (i >= in.size()) {return false;}
+    i++;
+  }
+  else {while (i < in.size() && (std::isalnum(static_cast<unsigned char>(in[i])) || in[i] == '-' || in[i] == '+' || in[i] == '.')) {i++;}}
+  token = in.substr(start, i - start);
+  return i > start;
+}
+
+inline std::string jsonUnquote(const std::string &token)
+{
+  if (token.empty() || token[0] != '"') {return token;}
+  std::string out;
+  for (size_t i = 1; i + 1 < token.size(); i++)
+  {
+    if (token[i] == '\\') {i++;} // Only the escaped character itself, which covers \" and \\ in the fields used here
+    out.push_back(token[i]);
+  }
+  return out;
+}
+
+inline std::string jsonQuote(const std::string &text)
+{
+  std::string out = "\"";
+  for (size_t i = 0; i < text.size(); i++)
+  {
+    if (text[i] == '"' || text[i] == '\\') {out.push_back('\\');}
+    if (static_cast<unsigned char>(text[i]) >= 0x20) {out.push_back(text[i]);}
+  }
+  return out + "\"";
+}
+
+// The fields of a flat JSON object, returns false if it doesn't parse
+inline bool parseJsonObject(const std::string &line, std::map<std::string, std::string> &fields)
+{
+  size_t i = 0;
+  while (i < line.size() && std::isspace(static_cast<unsigned char>(line[i]))) {i++;}
+  if (i >= line.size() || line[i++] != '{') {return false;}
+  while (true)
+  {
+    std::string key, value;
+    while (i < line.size() && std::isspace(static_cast<unsigned char>(line[i]))) {i++;}
+    if (i < line.size() && line[i] == '}' && fields.empty()) {return true;}
+    if (!jsonToken(line, i, key) || key[0] != '"') {return false;}
+    while (i < line.size() && std::isspace(static_cast<unsigned char>(line[i]))) {i++;}
+    if (i >= line.size() || line[i++] != ':') {return false;}
+    while (i < line.size() && std::isspace(static_cast<unsigned char>(line[i]))) {i++;}
+    if (!jsonToken(line, i, value)) {return false;}
+    fields[jsonUnquote(key)] = value;
+    while (i < line.size() && std::isspace(static_cast<unsigned char>(line[i]))) {i++;}
+    if (i < line.size() && line[i] == ',') {i++; continue;}
+    return i < line.size() && line[i] == '}';
+  }
+}
+
+// Progress reporting - each worker counts the Left Portion terms it finishes in its own slot, padded to a cache line so the
+// workers never share one, and relaxed as the counts are only read by the reporter thread
+struct TermCounter
+{
+  std::atomic<int64_t> terms;
+  char padding[64 - sizeof(std::atomic<int64_t>)];
+};
+
+struct Progress
+{
+  double interval = 0; // Seconds between reports, 0 for none
+  std::string jsonPath; // JSON lines for monitoring, as well as the text reports
+  int64_t planned = 0; // Terms the whole run will do
+  std::vector<TermCounter> counters; // One per worker, laid out by each program
+  // The GPU program does one series at a time and reports how far through it is, the CPU program leaves these at 0
+  std::atomic<int> series{0}; // j of the series being calculated
+  std::atomic<int64_t> seriesStart{0}, seriesTerms{0}; // Terms done before the series began, and its length
+
+  void count(size_t slot, int64_t terms) {if (interval > 0) {counters[slot].terms.fetch_add(terms, std::memory_order_relaxed);}}
+};
+Progress progress;
+
+// Prints terms done, the rate over the last interval and the ETA until it is destroyed
+class ProgressReporter
+{
+  public:
+    ProgressReporter()
+    {
+      if (progress.interval > 0) {reporter = std::thread(&ProgressReporter::reportLoop, this);}
+    }
+
+    ~ProgressReporter()
+    {
+      {
+        std::lock_guard<std::mutex> lock(stopMutex);
+        stopping = true;
+      }
+      stop.notify_all();
+      if (reporter.joinable()) {reporter.join();}
+    }
+
+  private:
+    std::thread reporter;
+    std::mutex stopMutex;
+    std::condition_variable stop;
+    bool stopping = false;
+
+    void reportLoop()
+    {
+      std::ofstream json;
+      if (!progress.jsonPath.empty())
+      {
+        json.open(progress.jsonPath);
+        if (!json) {std::cerr << "Can't write " << progress.jsonPath << std::endl;}
+      }
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      double lastTime = 0;
+      int64_t lastDone = 0;
+      std::unique_lock<std::mutex> lock(stopMutex);
+      while (!stop.wait_for(lock, std::chrono::duration<double>(progress.interval), [this]{ return stopping; }))
+      {
+        double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::vector<int64_t> workerTerms;
+        int64_t done = 0;
+        for (size_t i = 0; i < progress.counters.size(); i++)
+        {
+          workerTerms.push_back(progress.counters[i].terms.load(std::memory_order_relaxed));
+          done = done + workerTerms.back();
+        }
+        double rate = (done - lastDone) / (now - lastTime);
+        double eta = rate > 0 && progress.planned > done ? (progress.planned - done) / rate : 0;
+        lastTime = now;
+        lastDone = done;
+        int64_t seriesTerms = progress.seriesTerms.load(std::memory_order_relaxed);
+        int series = progress.series.load(std::memory_order_relaxed);
+        double seriesPercent = seriesTerms > 0 ? 100. * (done - progress.seriesStart.load(std::memory_order_relaxed)) / seriesTerms : 0.;
+        std::cerr << "Progress: ";
+        if (seriesTerms > 0) {std::cerr << "S" << series << " " << seriesPercent << "%, ";}
+        std::cerr << done << " of " << progress.planned << " terms (" << (progress.planned > 0 ? 100. * done / progress.planned : 0.)
+        << "%), " << rate << " terms/s, ETA " << eta << " s" << std::endl;
+        if (json.is_open())
+        {
+          json << "{\"time\":" << now;
+          if (seriesTerms > 0) {json << ",\"series\":" << series << ",\"seriesPercent\":" << seriesPercent;}
+          json << ",\"terms\":" << done << ",\"planned\":" << progress.planned << ",\"rate\":" << rate << ",\"eta\":" << eta << ",\"workers\":[";
+          for (size_t i = 0; i < workerTerms.size(); i++) {json << (i ? "," : "") << workerTerms[i];}
+          json << "]}" << std::endl;
+        }
+      }
+    }
+};
+
+// Profiling - with --profile each phase of a calculation is measured with hardware counters from perf_event_open. They are
+// opened before any worker threads with inherit set, so each counts every thread created after it. Each program names its
+// rows, the CPU program has one per phase and the GPU program one per phase of each series
+enum ProfilePhase { phaseLeft, phaseReduction, phaseRight, phaseCount };
+const char *phaseNames[phaseCount] = {"Left Portion", "Reduction", "Right Portion"};
+const int counterCount = 4;
+const char *counterNames[counterCount] = {"Cycles", "Instructions", "FP Ops", "Branch Misses"};
+
+class Profiler
+{
+  public:
+    bool enabled = false;
+
+    // rawFpEvent is the PMU's raw config for FP operations, 0 picks one for the CPU's vendor where known
+    void open(uint64_t rawFpEvent, const std::vector<std::string> &names)
+    {
+      enabled = true;
+      rows = names;
+      totals.assign(rows.size() * counterCount, 0.);
+      seconds.assign(rows.size(), 0.);
+      marks.assign(rows.size(), 0);
+#if defined(__linux__)
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_cpu_init();
+      if (rawFpEvent == 0 && __builtin_cpu_is("intel")) {rawFpEvent = 0xffc7;} // FP_ARITH_INST_RETIRED, every width
+      if (rawFpEvent == 0 && __builtin_cpu_is("amd")) {rawFpEvent = 0xff03;} // Retired SSE/AVX FLOPs, Zen
+#endif
+      uint32_t types[counterCount] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_RAW, PERF_TYPE_HARDWARE};
+      uint64_t configs[counterCount] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, rawFpEvent, PERF_COUNT_HW_BRANCH_MISSES};
+      for (int c = 0; c < counterCount; c++)
+      {
+        if (types[c] == PERF_TYPE_RAW && configs[c] == 0) {continue;}
+        perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.type = types[c];
+        attr.config = configs[c];
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING; // Scaled if the counters are multiplexed
+        fds[c] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+      }
+#else
+      (void)rawFpEvent;
+#endif
+      start();
+    }
+
+    ~Profiler()
+    {
+#if defined(__linux__)
+      for (int c = 0; c < counterCount; c++) {if (fds[c] >= 0) {close(fds[c]);}}
+#endif
+    }
+
+    // The next phase starts now
+    void start()
+    {
+      if (!enabled) {return;}
+      std::lock_guard<std::mutex> lock(mutex);
+      sample(last, lastTime);
+    }
+
+    // Count everything since the last mark as the given row
+    void phase(int row)
+    {
+      if (!enabled) {return;}
+      std::lock_guard<std::mutex> lock(mutex);
+      double now[counterCount];
+      std::chrono::steady_clock::time_point nowTime;
+      sample(now, nowTime);
+      for (int c = 0; c < counterCount; c++) {totals[row*counterCount + c] = totals[row*counterCount + c] + now[c] - last[c]; last[c] = now[c];}
+      seconds[row] = seconds[row] + std::chrono::duration<double>(nowTime - lastTime).count();
+      lastTime = nowTime;
+      marks[row]++;
+    }
+
+    void report(std::ostream &out, const char *title)
+    {
+      if (!enabled) {return;}
+      out << title << std::endl;
+      bool any = false;
+      for (int c = 0; c < counterCount; c++) {any = any || fds[c] >= 0;}
+      if (!any) {out << "  Hardware counters unavailable, see /proc/sys/kernel/perf_event_paranoid, times only" << std::endl;}
+      for (size_t r = 0; r < rows.size(); r++)
+      {
+        const double *counts = &totals[r*counterCount];
+        out << "  " << rows[r] << ": " << seconds[r] << " s over " << marks[r] << " calculations";
+        for (int c = 0; c < counterCount; c++)
+        {
+          if (fds[c] >= 0) {out << ", " << counterNames[c] << " " << counts[c];}
+        }
+        if (fds[0] >= 0 && fds[1] >= 0 && counts[0] > 0) {out << ", IPC " << counts[1] / counts[0];}
+        out << std::endl;
+      }
+    }
+
+  private:
+    int fds[counterCount] = {-1, -1, -1, -1};
+    std::mutex mutex;
+    double last[counterCount] = {};
+    std::chrono::steady_clock::time_point lastTime;
+    std::vector<std::string> rows;
+    std::vector<double> totals, seconds; // totals has counterCount for each row
+    std::vector<int64_t> marks;
+
+    void sample(double *values, std::chrono::steady_clock::time_point &time)
+    {
+      time = std::chrono::steady_clock::now();
+      for (int c = 0; c < counterCount; c++)
+      {
+        values[c] = 0;
+#if defined(__linux__)
+        uint64_t data[3] = {}; // Value, time enabled, time running
+        if (fds[c] >= 0 && ::read(fds[c], data, sizeof(data)) == static_cast<ssize_t>(sizeof(data)) && data[2] > 0) {values[c] = data[0] * (static_cast<double>(data[1]) / data[2]);}
+#endif
+      }
+    }
+};
+Profiler profiler;
+
+}
+
+#endif
@@ -0,0 +1,64 @@
+// Parallel Implementation of the Bailey–Borwein–Plouffe Formula for Pi (Library Interface)
+// Copyright (C) 2023 J. Madgwick
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Either program can be built as a library by defining BBP_PI_PARALLEL_LIBRARY, which leaves out its main. The engine
+// is the same one the command line uses: bbp-pi-parallel-cpu.cpp gives the CPU thread pool and result cache,
+// bbp-pi-parallel-gpu.cpp the HIP devices alongside CPU threads. Link one of them, not both
+
+#ifndef BBP_PI_PARALLEL_H
+#define BBP_PI_PARALLEL_H
+
+#include <cstdint>
+#include <string>
+
+// Options which choose the engine for each position, as the command line flags of the same names. The GPU engine only
+// has double, so it ignores them
+struct EngineOptions
+{
+  std::string backend = "auto"; // "auto", "fp" or "int"
+  std::string accumulator = "float"; // "float", "fixed64" or "fixed128"
+  std::string precision = "auto"; // "auto", "double", "long-double", "double-double" or "float128"
+  bool verify = false; // Also calculate the digits with Bellard's formula, CPU only
+};
+
+struct DigitResult
+{
+  bool ok = false;
+  std::string hex; // The guaranteed hex digits, up to nine, the first is the digit at the position
+  std::string engine; // Kernel and precision used, or why there's no result
+  std::string verifyHex; // The same digits from Bellard's formula, when verifying
+};
+
+// Sets up the threads (and devices) once and keeps them for every query. The engine uses the program's global state, so
+// there can only be one at a time, but hexDigits can be called from several threads at once
+class BbpEngine
+{
+  public:
+    // threads = 0 uses all available, cachePath is as --cache=FILE and empty for no cache
+    explicit BbpEngine(unsigned threads = 0, const std::string &cachePath = std::string());
+    ~BbpEngine();
+
+    // The hex digits of Pi from position (counted from 1, as the command line)
+    DigitResult hexDigits(int64_t position, const EngineOptions &options = EngineOptions());
+
+  private:
+    BbpEngine(const BbpEngine &) = delete;
+    BbpEngine &operator=(const BbpEngine &) = delete;
+    struct State;
+    State *state;
+};
+
+#endif